@@ -23,7 +23,6 @@
  * 	_ initialize next_deblock_idc at context_init rather than task to catch the latest nda value
  * 	_ make tasks start without waiting for availabilities, and wait inside all separate mv parsers
  * 	_ progressively replace waits with per-mb waits
- * 	_ limit n_threads and inferred CPUs to 16
  * 	_ remove taskPic now to remove a source of false sharing
  * 	_ try to improve parallel decoding of frames with disable_deblocking_idc==2
  * 	_ Update DPB availability checks to take deps into account, and make sure we wait until there is a frame ready before returning -2
@@ -127,20 +126,124 @@ static int parse_access_unit_delimiter(Edge264Decoder *dec, int non_blocking, vo
 }
 
 
+static int get_n_cpus(void) {
+	#ifdef _WIN32
+		int n_cpus = atoi(getenv("NUMBER_OF_PROCESSORS"));
+	#else
+		int n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	#endif
+	return min(n_cpus, MAX_TASKS);
+}
+
+
+
+/**
+ * This function is the entry point for each thread of a shared pool, where it
+ * consumes the tasks of all attached decoders in round-robin order. Since the
+ * lock order is dec->lock then pool->lock, ready_tasks is only peeked at
+ * atomically here, then checked again with dec->lock held.
+ */
+static void *pool_loop(Edge264Pool *pool) {
+	pthread_mutex_lock(&pool->lock);
+	while (!pool->exit_flag) {
+		Edge264Decoder **p = &pool->decoders, *dec;
+		while ((dec = *p) != NULL && !__atomic_load_n(&dec->ready_tasks, __ATOMIC_ACQUIRE))
+			p = &dec->pool_next;
+		if (dec == NULL) {
+			pthread_cond_wait(&pool->task_ready, &pool->lock);
+			continue;
+		}
+		
+		// move dec to the end of the list, such that other decoders are served first next time
+		*p = dec->pool_next;
+		while (*p != NULL)
+			p = &(*p)->pool_next;
+		*p = dec;
+		dec->pool_next = NULL;
+		dec->pool_refs++;
+		pthread_mutex_unlock(&pool->lock);
+		pthread_mutex_lock(&dec->lock);
+		if (dec->ready_tasks)
+			dec->decode_task(dec);
+		pthread_mutex_unlock(&dec->lock);
+		pthread_mutex_lock(&pool->lock);
+		if (--dec->pool_refs == 0)
+			pthread_cond_broadcast(&pool->released);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+
+
+Edge264Pool *edge264_pool_alloc(int n_threads) {
+	if (n_threads < 0)
+		n_threads = get_n_cpus();
+	if (n_threads == 0)
+		return NULL;
+	n_threads = min(n_threads, 1024);
+	Edge264Pool *pool = calloc(1, sizeof(Edge264Pool) + n_threads * sizeof(pthread_t));
+	if (pool == NULL)
+		return NULL;
+	pool->n_threads = n_threads;
+	if (pthread_mutex_init(&pool->lock, NULL) == 0) {
+		if (pthread_cond_init(&pool->task_ready, NULL) == 0) {
+			if (pthread_cond_init(&pool->released, NULL) == 0) {
+				int i = 0;
+				while (i < n_threads && pthread_create(&pool->threads[i], NULL, (void*(*)(void*))pool_loop, pool) == 0)
+					i++;
+				if (i == n_threads)
+					return pool;
+				pool->n_threads = i;
+				edge264_pool_free(&pool);
+				return NULL;
+			}
+			pthread_cond_destroy(&pool->task_ready);
+		}
+		pthread_mutex_destroy(&pool->lock);
+	}
+	free(pool);
+	return NULL;
+}
+
+
+
+void edge264_pool_free(Edge264Pool **ppool) {
+	Edge264Pool *pool;
+	if (ppool != NULL && (pool = *ppool) != NULL) {
+		*ppool = NULL;
+		pthread_mutex_lock(&pool->lock);
+		pool->exit_flag = 1;
+		pthread_cond_broadcast(&pool->task_ready);
+		pthread_mutex_unlock(&pool->lock);
+		for (int i = 0; i < pool->n_threads; i++)
+			pthread_join(pool->threads[i], NULL);
+		pthread_mutex_destroy(&pool->lock);
+		pthread_cond_destroy(&pool->task_ready);
+		pthread_cond_destroy(&pool->released);
+		free(pool);
+	}
+}
+
+
+
 #if EDGE264_TRACE
-Edge264Decoder *edge264_alloc(int n_threads, FILE *trace_headers, FILE *trace_slices) {
+Edge264Decoder *edge264_alloc(int n_threads, Edge264Pool *pool, void *(*alloc_cb)(void *alloc_arg, size_t size), void (*dealloc_cb)(void *alloc_arg, void *ptr), void *alloc_arg, FILE *trace_headers, FILE *trace_slices) {
 #else
-Edge264Decoder *edge264_alloc(int n_threads) {
+Edge264Decoder *edge264_alloc(int n_threads, Edge264Pool *pool, void *(*alloc_cb)(void *alloc_arg, size_t size), void (*dealloc_cb)(void *alloc_arg, void *ptr), void *alloc_arg) {
 #endif
 	Edge264Decoder *dec = calloc(1, sizeof(Edge264Decoder));
 	if (dec == NULL)
 		return NULL;
-	dec->n_threads = n_threads;
+	dec->alloc_cb = alloc_cb;
+	dec->dealloc_cb = dealloc_cb;
+	dec->alloc_arg = alloc_arg;
 	#if EDGE264_TRACE
 	dec->trace_headers = trace_headers;
 	dec->trace_slices = trace_slices;
 	#endif	
-	dec->taskPics_v = set8(-1);
+	for (int i = 0; i < MAX_TASKS / 16; i++)
+		dec->taskPics_v[i] = set8(-1);
 	
 	// select parser functions based on CPU capabilities
 	#if defined(__SSE2__) // if compiled for Intel
@@ -149,6 +252,9 @@ Edge264Decoder *edge264_alloc(int n_threads) {
 			return free(dec), NULL;
 	#endif
 	void *(*w)(Edge264Decoder *) = ADD_VARIANT(worker_loop);
+	dec->decode_task = ADD_VARIANT(decode_task);
+	dec->convert_tensor = ADD_VARIANT(convert_tensor);
+	dec->probe_slice_header = ADD_VARIANT(probe_slice_header);
 	dec->parse_nal_unit[1] = dec->parse_nal_unit[5] = ADD_VARIANT(parse_slice_layer_without_partitioning);
 	dec->parse_nal_unit[7] = dec->parse_nal_unit[15] = ADD_VARIANT(parse_seq_parameter_set);
 	dec->parse_nal_unit[8] = ADD_VARIANT(parse_pic_parameter_set);
@@ -168,6 +274,9 @@ Edge264Decoder *edge264_alloc(int n_threads) {
 			dec->parse_nal_unit[13] = parse_seq_parameter_set_extension_v2;
 			dec->parse_nal_unit[14] = dec->parse_nal_unit[20] = parse_nal_unit_header_extension_v2;
 			w = worker_loop_v2;
+			dec->decode_task = decode_task_v2;
+			dec->convert_tensor = convert_tensor_v2;
+			dec->probe_slice_header = probe_slice_header_v2;
 		}
 	#endif
 	#ifdef TEST_X86_64_V3
@@ -182,6 +291,9 @@ Edge264Decoder *edge264_alloc(int n_threads) {
 			dec->parse_nal_unit[13] = parse_seq_parameter_set_extension_v3;
 			dec->parse_nal_unit[14] = dec->parse_nal_unit[20] = parse_nal_unit_header_extension_v3;
 			w = worker_loop_v3;
+			dec->decode_task = decode_task_v3;
+			dec->convert_tensor = convert_tensor_v3;
+			dec->probe_slice_header = probe_slice_header_v3;
 		}
 	#endif
 	#if EDGE264_TRACE
@@ -193,6 +305,9 @@ Edge264Decoder *edge264_alloc(int n_threads) {
 			dec->parse_nal_unit[13] = parse_seq_parameter_set_extension_debug;
 			dec->parse_nal_unit[14] = dec->parse_nal_unit[20] = parse_nal_unit_header_extension_debug;
 			w = worker_loop_debug;
+			dec->decode_task = decode_task_debug;
+			dec->convert_tensor = convert_tensor_debug;
+			dec->probe_slice_header = probe_slice_header_debug;
 		#else
 			return free(dec), NULL;
 		#endif
@@ -200,14 +315,12 @@ Edge264Decoder *edge264_alloc(int n_threads) {
 	#endif
 	
 	// get the number of logical cores if requested
-	if (n_threads < 0) {
-		#ifdef _WIN32
-			int n_cpus = atoi(getenv("NUMBER_OF_PROCESSORS"));
-		#else
-			int n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
-		#endif
-		n_threads = min(n_cpus, 16);
+	if (pool != NULL) {
+		n_threads = pool->n_threads;
+	} else if (n_threads < 0) {
+		n_threads = get_n_cpus();
 	}
+	dec->n_threads = n_threads = min(n_threads, MAX_TASKS);
 	
 	// if multithreading is disabled we are done, otherwise initialize all
 	if (n_threads == 0)
@@ -216,15 +329,23 @@ Edge264Decoder *edge264_alloc(int n_threads) {
 		if (pthread_cond_init(&dec->task_ready, NULL) == 0) {
 			if (pthread_cond_init(&dec->task_progress, NULL) == 0) {
 				if (pthread_cond_init(&dec->task_complete, NULL) == 0) {
+					if (pool != NULL) {
+						dec->pool = pool;
+						pthread_mutex_lock(&pool->lock);
+						dec->pool_next = pool->decoders;
+						pool->decoders = dec;
+						pthread_mutex_unlock(&pool->lock);
+						return dec;
+					}
 					int i = 0;
 					while (i < n_threads && pthread_create(&dec->threads[i], NULL, (void*(*)(void*))w, dec) == 0)
 						i++;
 					if (i == n_threads) {
 						return dec;
 					}
-					while (i-- > 0)
-						pthread_cancel(dec->threads[i]);
-					pthread_cond_destroy(&dec->task_complete);
+					dec->n_threads = i;
+					edge264_free(&dec);
+					return NULL;
 				}
 				pthread_cond_destroy(&dec->task_progress);
 			}
@@ -238,6 +359,25 @@ Edge264Decoder *edge264_alloc(int n_threads) {
 
 
 
+/**
+ * Probing contexts parse no slice, and keep only the SPS and its dimensions
+ * when parsing one, thus never allocate any frame buffer or task state.
+ */
+Edge264Decoder *edge264_probe_alloc(void) {
+	#if EDGE264_TRACE
+		Edge264Decoder *dec = edge264_alloc(0, NULL, NULL, NULL, NULL, NULL, NULL);
+	#else
+		Edge264Decoder *dec = edge264_alloc(0, NULL, NULL, NULL, NULL);
+	#endif
+	if (dec != NULL) {
+		dec->probe_only = 1;
+		dec->parse_nal_unit[1] = dec->parse_nal_unit[5] = dec->parse_nal_unit[20] = NULL;
+	}
+	return dec;
+}
+
+
+
 void edge264_flush(Edge264Decoder *dec) {
 	if (dec == NULL)
 		return;
@@ -246,14 +386,19 @@ void edge264_flush(Edge264Decoder *dec) {
 	// FIXME interrupt all threads
 	dec->currPic = dec->basePic = -1;
 	dec->reference_flags = dec->long_term_flags = dec->output_flags = 0;
-	for (unsigned b = dec->busy_tasks; b; b &= b - 1) {
-		Edge264Task *t = dec->tasks + __builtin_ctz(b);
+	dec->refs_dropped = 0;
+	for (uint64_t b = dec->busy_tasks; b; b &= b - 1) {
+		Edge264Task *t = dec->tasks + ctz64(b);
 		if (t->free_cb)
 			t->free_cb(t->free_arg, 0);
 	}
-	dec->busy_tasks = dec->pending_tasks = dec->ready_tasks = 0;
-	dec->task_dependencies_v[0] = dec->task_dependencies_v[1] = dec->task_dependencies_v[2] = dec->task_dependencies_v[3] = (i32x4){};
-	dec->taskPics_v = set8(-1);
+	dec->busy_tasks = dec->pending_tasks = dec->reference_tasks = dec->deblock_tasks = dec->recon_tasks = 0;
+	__atomic_store_n(&dec->ready_tasks, 0, __ATOMIC_RELEASE);
+	dec->stream_start = dec->stream_end = dec->stream_scan = dec->stream_synced = 0;
+	for (int i = 0; i < MAX_TASKS / 4; i++)
+		dec->task_dependencies_v[i] = (i32x4){};
+	for (int i = 0; i < MAX_TASKS / 16; i++)
+		dec->taskPics_v[i] = set8(-1);
 	if (dec->n_threads)
 		pthread_mutex_unlock(&dec->lock);
 }
@@ -264,9 +409,33 @@ void edge264_free(Edge264Decoder **pdec) {
 	Edge264Decoder *dec;
 	if (pdec != NULL && (dec = *pdec) != NULL) {
 		*pdec = NULL;
-		if (dec->n_threads) {
+		if (dec->pool != NULL) {
+			// let pool threads finish all tasks, then detach once none holds dec
+			Edge264Pool *pool = dec->pool;
+			pthread_mutex_lock(&dec->lock);
+			while (dec->busy_tasks)
+				pthread_cond_wait(&dec->task_complete, &dec->lock);
+			pthread_mutex_unlock(&dec->lock);
+			pthread_mutex_lock(&pool->lock);
+			Edge264Decoder **p = &pool->decoders;
+			while (*p != dec)
+				p = &(*p)->pool_next;
+			*p = dec->pool_next;
+			while (dec->pool_refs)
+				pthread_cond_wait(&pool->released, &pool->lock);
+			pthread_mutex_unlock(&pool->lock);
+		} else if (dec->n_threads) {
+			// let own threads finish all tasks, then join them before dec is freed under them
+			pthread_mutex_lock(&dec->lock);
+			while (dec->busy_tasks)
+				pthread_cond_wait(&dec->task_complete, &dec->lock);
+			dec->exit_flag = 1;
+			pthread_cond_broadcast(&dec->task_ready);
+			pthread_mutex_unlock(&dec->lock);
 			for (int i = 0; i < dec->n_threads; i++)
-				pthread_cancel(dec->threads[i]);
+				pthread_join(dec->threads[i], NULL);
+		}
+		if (dec->n_threads) {
 			pthread_mutex_destroy(&dec->lock);
 			pthread_cond_destroy(&dec->task_ready);
 			pthread_cond_destroy(&dec->task_progress);
@@ -274,8 +443,11 @@ void edge264_free(Edge264Decoder **pdec) {
 		}
 		for (int i = 0; i < 32; i++) {
 			if (dec->frame_buffers[i] != NULL)
-				free(dec->frame_buffers[i]);
+				free_frame(dec, i);
 		}
+		free(dec->pipe.ops);
+		free(dec->mbp_rings);
+		free(dec->stream_buf);
 		free(dec);
 	}
 }
@@ -286,8 +458,12 @@ void edge264_free(Edge264Decoder **pdec) {
  * Maximum buffer size is 2^(SIZE_BIT-1)-1, and pointer comparisons are coded
  * to allow wrapping around memory, so the buffer may be close to end of memory
  * without risk.
+ * 
+ * When nal_end_known is set (length-prefixed input), end is the exact end of
+ * the NAL unit, so that neither the slice tasks nor next_NAL need to look for
+ * the next start code.
  */
-int edge264_decode_NAL(Edge264Decoder *dec, const uint8_t *buf, const uint8_t *end, int non_blocking, void(*free_cb)(void*,int), void *free_arg, const uint8_t **next_NAL)
+static int decode_NAL(Edge264Decoder *dec, const uint8_t *buf, const uint8_t *end, int nal_end_known, int non_blocking, void(*free_cb)(void*,int), void *free_arg, const uint8_t **next_NAL)
 {
 	#if EDGE264_TRACE
 	static const char * const nal_unit_type_names[32] = {
@@ -317,22 +493,22 @@ int edge264_decode_NAL(Edge264Decoder *dec, const uint8_t *buf, const uint8_t *e
 	#endif
 	
 	// initial checks before parsing
-	if (dec == NULL || buf == NULL && end != NULL)
-		return EINVAL;
 	if (dec->n_threads)
 		pthread_mutex_lock(&dec->lock);
 	if (__builtin_expect((intptr_t)(end - buf) <= 0, 0)) {
 		for (unsigned o = dec->output_flags; o; o &= o - 1)
 			dec->dispPicOrderCnt = max(dec->dispPicOrderCnt, dec->FieldOrderCnt[0][__builtin_ctz(o)]);
-		unsigned busy;
+		uint64_t busy;
 		while ((busy = dec->busy_tasks) && !non_blocking)
 			pthread_cond_wait(&dec->task_complete, &dec->lock);
+		output_frames(dec);
 		if (dec->n_threads)
 			pthread_mutex_unlock(&dec->lock);
 		return busy ? EWOULDBLOCK : ENODATA;
 	}
 	dec->nal_ref_idc = buf[0] >> 5;
 	dec->nal_unit_type = buf[0] & 0x1f;
+	dec->nal_end_known = nal_end_known;
 	#if EDGE264_TRACE
 	if (dec->trace_headers) {
 		fprintf(dec->trace_headers, "<k>nal_ref_idc</k><v>%u</v>\n"
@@ -368,72 +544,261 @@ int edge264_decode_NAL(Edge264Decoder *dec, const uint8_t *buf, const uint8_t *e
 		if (free_cb && !(ret == 0 && 1048610 & 1 << dec->nal_unit_type)) // 1, 5 or 20
 			free_cb(free_arg, ret);
 		if (next_NAL)
-			*next_NAL = edge264_find_start_code(buf, end) + 3;
+			*next_NAL = nal_end_known ? end : edge264_find_start_code(buf, end) + 3;
 	}
+	output_frames(dec);
 	if (dec->n_threads)
 		pthread_mutex_unlock(&dec->lock);
 	return ret;
 }
 
+int edge264_decode_NAL(Edge264Decoder *dec, const uint8_t *buf, const uint8_t *end, int non_blocking, void(*free_cb)(void*,int), void *free_arg, const uint8_t **next_NAL)
+{
+	if (dec == NULL || buf == NULL && end != NULL)
+		return EINVAL;
+	return decode_NAL(dec, buf, end, 0, non_blocking, free_cb, free_arg, next_NAL);
+}
+
 
 
 /**
- * By default all frames with POC lower or equal with the last non-reference
- * picture or lower than the last IDR picture are considered for output.
- * This function will consider all frames instead if either:
- * _ there are more frames to output than max_num_reorder_frames
- * _ there is no empty slot for the next frame
+ * Length-prefixed NAL units (as stored in MP4/MKV) are decoded in place, the
+ * prefix giving the exact end of each NAL unit. A zero or overflowing length
+ * is reported as EBADMSG without reaching the decoder, with next_NAL set past
+ * the NAL unit or at end if the length cannot be trusted.
  */
-int edge264_get_frame(Edge264Decoder *dec, Edge264Frame *out, int borrow) {
-	if (dec == NULL || out == NULL)
+int edge264_decode_AVCC(Edge264Decoder *dec, const uint8_t *buf, const uint8_t *end, int length_size, int non_blocking, void(*free_cb)(void*,int), void *free_arg, const uint8_t **next_NAL)
+{
+	if (dec == NULL || buf == NULL && end != NULL || length_size != 1 && length_size != 2 && length_size != 4)
+		return EINVAL;
+	if ((intptr_t)(end - buf) <= 0)
+		return decode_NAL(dec, buf, end, 1, non_blocking, free_cb, free_arg, next_NAL);
+	size_t size = 0;
+	for (int i = 0; i < length_size && i < end - buf; i++)
+		size = size << 8 | buf[i];
+	if ((intptr_t)(end - buf) <= length_size || size - 1 >= (size_t)(end - buf - length_size)) {
+		if (free_cb)
+			free_cb(free_arg, EBADMSG);
+		if (next_NAL)
+			*next_NAL = ((intptr_t)(end - buf) <= length_size || size > end - buf - length_size) ? end : buf + length_size;
+		return EBADMSG;
+	}
+	return decode_NAL(dec, buf + length_size, buf + length_size + size, 1, non_blocking, free_cb, free_arg, next_NAL);
+}
+
+
+
+/**
+ * The avcC box (ISO/IEC 14496-15 AVCDecoderConfigurationRecord) contains the
+ * NAL length size and all the SPS and PPS needed to start decoding, which are
+ * decoded in order here. The high profile extension after the PPS is ignored.
+ */
+int edge264_decode_avcC(Edge264Decoder *dec, const uint8_t *buf, const uint8_t *end, int *length_size)
+{
+	if (dec == NULL || buf == NULL)
+		return EINVAL;
+	if ((intptr_t)(end - buf) < 7 || buf[0] != 1 || (buf[4] & 3) == 2)
+		return EBADMSG;
+	if (length_size)
+		*length_size = (buf[4] & 3) + 1;
+	int ret = 0;
+	const uint8_t *p = buf + 5;
+	for (int i = 0; i < 2; i++) { // SPS then PPS
+		if ((intptr_t)(end - p) <= 0)
+			return EBADMSG;
+		for (int num = *p++ & (i ? 255 : 31); num > 0; num--) {
+			int size = (intptr_t)(end - p) < 2 ? -1 : p[0] << 8 | p[1];
+			if (size <= 0 || size > end - p - 2)
+				return EBADMSG;
+			int res = decode_NAL(dec, p + 2, p + 2 + size, 1, 0, NULL, NULL, NULL);
+			ret = ret ? ret : res; // report the first error, but decode all parameter sets
+			p += 2 + size;
+		}
+	}
+	return ret;
+}
+
+
+
+/**
+ * Probing parses parameter sets like decoding, but stops slices after their
+ * POC. It requires a context from edge264_probe_alloc, such that parameter
+ * sets never trigger the allocation of frames or tasks.
+ */
+int edge264_probe_NAL(Edge264Decoder *dec, const uint8_t *buf, const uint8_t *end, Edge264NalInfo *info, const uint8_t **next_NAL)
+{
+	if (dec == NULL || !dec->probe_only || info == NULL || buf == NULL && end != NULL)
 		return EINVAL;
+	if ((intptr_t)(end - buf) <= 0)
+		return ENODATA;
 	if (dec->n_threads)
 		pthread_mutex_lock(&dec->lock);
-	int pic[2] = {-1, -1};
-	unsigned unavail = dec->reference_flags | dec->output_flags | (dec->basePic < 0 ? 0 : 1 << dec->basePic);
-	int best = (__builtin_popcount(dec->output_flags) > dec->sps.max_num_reorder_frames ||
-		__builtin_popcount(unavail) >= dec->sps.num_frame_buffers) ? INT_MAX : dec->dispPicOrderCnt;
-	for (int o = dec->output_flags; o != 0; o &= o - 1) {
-		int i = __builtin_ctz(o);
-		if (dec->FieldOrderCnt[0][i] <= best) {
-			int non_base = dec->sps.mvc & i & 1;
-			if (dec->FieldOrderCnt[0][i] < best) {
-				best = dec->FieldOrderCnt[0][i];
-				pic[non_base ^ 1] = -1;
+	memset(info, 0, sizeof(*info));
+	info->nal_ref_idc = dec->nal_ref_idc = buf[0] >> 5;
+	info->nal_unit_type = dec->nal_unit_type = buf[0] & 0x1f;
+	info->slice_type = -1;
+	int ret = 0;
+	if ((intptr_t)(end - buf) >= 2 && (0x1081a2 & 1 << dec->nal_unit_type)) { // 1, 5, 7, 8, 15 or 20
+		dec->_gb.msb_cache = (size_t)buf[1] << (SIZE_BIT - 8) | (size_t)1 << (SIZE_BIT - 9);
+		dec->_gb.lsb_cache = 0;
+		dec->_gb.CPB = buf + 2;
+		dec->_gb.end = end;
+		if (0x100022 & 1 << dec->nal_unit_type) // 1, 5 or 20
+			ret = dec->probe_slice_header(dec, info);
+		else
+			ret = dec->parse_nal_unit[dec->nal_unit_type](dec, 0, NULL, NULL);
+		buf = minp(dec->_gb.CPB - 2, dec->_gb.end);
+	} else if ((intptr_t)(end - buf) < 2 && (0x1081a2 & 1 << dec->nal_unit_type)) {
+		ret = EBADMSG;
+	}
+	info->width_Y = dec->out.width_Y;
+	info->height_Y = dec->out.height_Y;
+	info->width_mbs = dec->out.width_mbs;
+	info->height_mbs = dec->out.height_mbs;
+	if (next_NAL)
+		*next_NAL = edge264_find_start_code(buf, end) + 3;
+	if (dec->n_threads)
+		pthread_mutex_unlock(&dec->lock);
+	return ret;
+}
+
+
+
+static void release_stream_NAL(void *hold, int ret) {
+	*(int32_t *)hold = 0;
+}
+
+/**
+ * Chunks are copied to a single buffer where each NAL unit is reassembled
+ * contiguously, such that it can be parsed in place like with decode_NAL.
+ * Start codes and escape sequences split across chunks are thus handled by
+ * simply resuming the search 2 bytes before the end of the last chunk. NAL
+ * units held by slice tasks are left untouched, and when the end of buffer is
+ * reached the incomplete NAL unit is moved back to its start if it does not
+ * overlap them. The buffer is only grown when a single NAL unit does not fit,
+ * so memory stays bounded by the size of the largest NAL units.
+ */
+int edge264_decode_chunk(Edge264Decoder *dec, const uint8_t *buf, const uint8_t *end, int non_blocking, const uint8_t **next_byte)
+{
+	if (dec == NULL || buf == NULL && end != NULL)
+		return EINVAL;
+	if (dec->n_threads)
+		pthread_mutex_lock(&dec->lock);
+	int ret;
+	for (;;) {
+		ret = ENODATA;
+		
+		// copy as many bytes as possible, moving or growing the buffer when full
+		while ((intptr_t)(end - buf) > 0) {
+			int32_t first_hold = dec->stream_size, next_hold = dec->stream_size;
+			for (int i = 0; i <= MAX_TASKS; i++) {
+				int32_t h = dec->stream_holds[i] - 1;
+				if (h >= 0)
+					first_hold = min(first_hold, h);
+				if (h >= dec->stream_end)
+					next_hold = min(next_hold, h);
+			}
+			int32_t len = dec->stream_end - dec->stream_start;
+			if (next_hold > dec->stream_end) {
+				int32_t n = (size_t)(end - buf) < next_hold - dec->stream_end ? end - buf : next_hold - dec->stream_end;
+				memcpy(dec->stream_buf + dec->stream_end, buf, n);
+				dec->stream_end += n;
+				buf += n;
+			} else if (dec->stream_start > 0 && first_hold > len) {
+				memmove(dec->stream_buf, dec->stream_buf + dec->stream_start, len);
+				dec->stream_scan -= dec->stream_start;
+				dec->stream_start = 0;
+				dec->stream_end = len;
+			} else if (first_hold == dec->stream_size && dec->stream_size <= INT32_MAX / 2) {
+				int32_t size = max(dec->stream_size * 2, STREAM_BUFFER_SIZE);
+				uint8_t *p = malloc(size);
+				if (p == NULL) {
+					ret = ENOMEM;
+					break;
+				}
+				memcpy(p, dec->stream_buf + dec->stream_start, len);
+				free(dec->stream_buf);
+				dec->stream_buf = p;
+				dec->stream_size = size;
+				dec->stream_scan -= dec->stream_start;
+				dec->stream_start = 0;
+				dec->stream_end = len;
+			} else {
+				ret = first_hold == dec->stream_size ? ENOMEM : EWOULDBLOCK;
+				break;
 			}
-			pic[non_base] = i;
 		}
-	}
-	
-	int res = ENOMSG;
-	if (pic[0] >= 0 && dec->next_deblock_addr[pic[0]] == INT_MAX && (pic[1] < 0 || dec->next_deblock_addr[pic[1]] == INT_MAX)) {
-		*out = dec->out;
-		int top = dec->out.frame_crop_offsets[0];
-		int left = dec->out.frame_crop_offsets[3];
-		int offY = top * dec->out.stride_Y + (left << dec->out.pixel_depth_Y);
-		int topC = dec->sps.chroma_format_idc == 3 ? top : top >> 1;
-		int leftC = dec->sps.chroma_format_idc == 1 ? left >> 1 : left;
-		int offC = dec->plane_size_Y + topC * dec->out.stride_C + (leftC << dec->out.pixel_depth_C);
-		dec->output_flags ^= 1 << pic[0];
-		const uint8_t *samples = dec->frame_buffers[pic[0]];
-		out->samples[0] = samples + offY;
-		out->samples[1] = samples + offC;
-		out->samples[2] = samples + (dec->out.stride_C >> 1) + offC;
-		out->TopFieldOrderCnt = best << 6 >> 6;
-		out->BottomFieldOrderCnt = dec->FieldOrderCnt[1][pic[0]] << 6 >> 6;
-		out->return_arg = (void *)((size_t)1 << pic[0]);
-		if (pic[1] >= 0) {
-			dec->output_flags ^= 1 << pic[1];
-			samples = dec->frame_buffers[pic[1]];
-			out->samples_mvc[0] = samples + offY;
-			out->samples_mvc[1] = samples + offC;
-			out->samples_mvc[2] = samples + (dec->out.stride_C >> 1) + offC;
-			out->return_arg = (void *)((size_t)1 << pic[0] | (size_t)1 << pic[1]);
+		
+		// skip any bytes before the first start code
+		const uint8_t *start = dec->stream_buf + dec->stream_start;
+		const uint8_t *stop = dec->stream_buf + dec->stream_end;
+		const uint8_t *sc = stop;
+		if (dec->stream_end - dec->stream_scan >= 3)
+			sc = edge264_find_start_code(dec->stream_buf + dec->stream_scan, stop);
+		if ((intptr_t)(stop - sc) < 3) // stale bytes past stop may complete a start code
+			sc = stop;
+		if (!dec->stream_synced && sc < stop) {
+			dec->stream_synced = 1;
+			dec->stream_start = dec->stream_scan = sc + 3 - dec->stream_buf;
+			continue;
+		}
+		dec->stream_scan = sc < stop ? sc - dec->stream_buf : max(dec->stream_scan, dec->stream_end - 2);
+		if (!dec->stream_synced)
+			dec->stream_start = dec->stream_scan;
+		
+		// decode the next NAL unit if complete, or the last one at end of stream
+		if (dec->stream_synced && (sc < stop || (buf == NULL && start < stop))) {
+			const uint8_t *nal_end = sc;
+			while (nal_end > start && nal_end[-1] == 0) // trailing_zero_8bits
+				nal_end--;
+			int32_t *hold = dec->stream_holds;
+			while (*hold)
+				hold++;
+			*hold = dec->stream_start + 1;
+			if (dec->n_threads)
+				pthread_mutex_unlock(&dec->lock);
+			ret = nal_end > start ? decode_NAL(dec, start, nal_end, 1, non_blocking, release_stream_NAL, hold, NULL) : EBADMSG;
+			if (dec->n_threads)
+				pthread_mutex_lock(&dec->lock);
+			if (ret == 0 || ret == ENOTSUP || ret == EBADMSG) {
+				dec->stream_start = dec->stream_scan = min(sc + 3 - dec->stream_buf, dec->stream_end);
+				if (nal_end <= start)
+					*hold = 0;
+			} else {
+				*hold = 0;
+			}
+			break;
 		}
-		res = 0;
-		if (borrow)
-			dec->borrow_flags |= (size_t)out->return_arg;
+		
+		// at end of stream let decode_NAL wait for all tasks, otherwise wait until some NAL unit is released
+		if (buf == NULL) {
+			dec->stream_start = dec->stream_end = dec->stream_scan = dec->stream_synced = 0;
+			if (dec->n_threads)
+				pthread_mutex_unlock(&dec->lock);
+			ret = decode_NAL(dec, NULL, NULL, 1, non_blocking, NULL, NULL, NULL);
+			if (dec->n_threads)
+				pthread_mutex_lock(&dec->lock);
+			break;
+		}
+		if (ret != EWOULDBLOCK || non_blocking || !dec->n_threads)
+			break;
+		pthread_cond_wait(&dec->task_complete, &dec->lock);
 	}
+	if (dec->n_threads)
+		pthread_mutex_unlock(&dec->lock);
+	if (next_byte)
+		*next_byte = buf;
+	return ret;
+}
+
+
+
+int edge264_get_frame(Edge264Decoder *dec, Edge264Frame *out, int borrow) {
+	if (dec == NULL || out == NULL)
+		return EINVAL;
+	if (dec->n_threads)
+		pthread_mutex_lock(&dec->lock);
+	int res = pop_frame(dec, out, borrow);
 	if (dec->n_threads)
 		pthread_mutex_unlock(&dec->lock);
 	return res;
@@ -441,6 +806,199 @@ int edge264_get_frame(Edge264Decoder *dec, Edge264Frame *out, int borrow) {
 
 
 
+int edge264_set_output_cb(Edge264Decoder *dec, void (*output_cb)(void *output_arg, const Edge264Frame *frame), void *output_arg, int borrow) {
+	if (dec == NULL)
+		return EINVAL;
+	if (dec->n_threads)
+		pthread_mutex_lock(&dec->lock);
+	dec->output_cb = output_cb;
+	dec->output_arg = output_arg;
+	dec->output_borrow = borrow != 0;
+	output_frames(dec);
+	if (dec->n_threads)
+		pthread_mutex_unlock(&dec->lock);
+	return 0;
+}
+
+
+
+int edge264_set_skip_mode(Edge264Decoder *dec, Edge264SkipMode mode) {
+	if (dec == NULL || (unsigned)mode > EDGE264_SKIP_NON_IDR)
+		return EINVAL;
+	if (dec->n_threads)
+		pthread_mutex_lock(&dec->lock);
+	dec->skip_mode = mode;
+	if (dec->n_threads)
+		pthread_mutex_unlock(&dec->lock);
+	return 0;
+}
+
+
+
+int edge264_set_deblock_mode(Edge264Decoder *dec, Edge264DeblockMode mode) {
+	if (dec == NULL || (unsigned)mode > EDGE264_DEBLOCK_NONE)
+		return EINVAL;
+	if (dec->n_threads)
+		pthread_mutex_lock(&dec->lock);
+	dec->deblock_mode = mode;
+	if (dec->n_threads)
+		pthread_mutex_unlock(&dec->lock);
+	return 0;
+}
+
+
+
+int edge264_set_frame_deadline(Edge264Decoder *dec, int64_t frame_period_ns) {
+	if (dec == NULL || frame_period_ns < 0)
+		return EINVAL;
+	if (dec->n_threads)
+		pthread_mutex_lock(&dec->lock);
+	dec->deadline_period = frame_period_ns;
+	dec->deadline_next = 0;
+	dec->deadline_level = 0;
+	if (dec->n_threads)
+		pthread_mutex_unlock(&dec->lock);
+	return 0;
+}
+
+
+
+int edge264_set_mb_info_mode(Edge264Decoder *dec, Edge264MbInfoMode mode) {
+	if (dec == NULL || (unsigned)mode > EDGE264_MB_INFO_ONLY)
+		return EINVAL;
+	if (dec->n_threads)
+		pthread_mutex_lock(&dec->lock);
+	dec->mb_info_mode = mode;
+	if (dec->n_threads)
+		pthread_mutex_unlock(&dec->lock);
+	return 0;
+}
+
+
+
+int edge264_set_mb_maps(Edge264Decoder *dec, int enable) {
+	if (dec == NULL)
+		return EINVAL;
+	if (dec->n_threads)
+		pthread_mutex_lock(&dec->lock);
+	dec->mb_maps_enabled = enable != 0;
+	if (dec->n_threads)
+		pthread_mutex_unlock(&dec->lock);
+	return 0;
+}
+
+
+
+int edge264_set_prealloc_mode(Edge264Decoder *dec, Edge264PreallocMode mode) {
+	if (dec == NULL || (unsigned)mode > EDGE264_PREALLOC_LOCK)
+		return EINVAL;
+	if (dec->n_threads)
+		pthread_mutex_lock(&dec->lock);
+	dec->prealloc_mode = mode;
+	if (dec->n_threads)
+		pthread_mutex_unlock(&dec->lock);
+	return 0;
+}
+
+
+
+int edge264_set_huge_pages(Edge264Decoder *dec, int enable) {
+	if (dec == NULL)
+		return EINVAL;
+	if (dec->n_threads)
+		pthread_mutex_lock(&dec->lock);
+	dec->huge_pages = enable != 0;
+	if (dec->n_threads)
+		pthread_mutex_unlock(&dec->lock);
+	return 0;
+}
+
+
+
+int edge264_set_luma_only(Edge264Decoder *dec, int enable) {
+	if (dec == NULL)
+		return EINVAL;
+	if (dec->n_threads)
+		pthread_mutex_lock(&dec->lock);
+	dec->luma_only = enable != 0;
+	if (dec->n_threads)
+		pthread_mutex_unlock(&dec->lock);
+	return 0;
+}
+
+
+
+int edge264_set_output_scale(Edge264Decoder *dec, int shift) {
+	if (dec == NULL || (unsigned)shift > 2)
+		return EINVAL;
+	if (dec->n_threads)
+		pthread_mutex_lock(&dec->lock);
+	dec->scale_shift = shift;
+	if (dec->n_threads)
+		pthread_mutex_unlock(&dec->lock);
+	return 0;
+}
+
+
+
+int edge264_set_output_format(Edge264Decoder *dec, Edge264OutputFormat format) {
+	if (dec == NULL || (unsigned)format > EDGE264_FORMAT_BGR24)
+		return EINVAL;
+	if (dec->n_threads)
+		pthread_mutex_lock(&dec->lock);
+	dec->output_format = format;
+	if (dec->n_threads)
+		pthread_mutex_unlock(&dec->lock);
+	return 0;
+}
+
+
+
+int edge264_convert_tensor(Edge264Decoder *dec, const Edge264Frame *frame, float *tensor, int index, const float *mean, const float *std, int bgr) {
+	if (dec == NULL || frame == NULL || frame->samples[0] == NULL || tensor == NULL || mean == NULL || std == NULL || index < 0 || frame->pixel_depth_Y)
+		return EINVAL;
+	return dec->convert_tensor(frame, tensor + (size_t)index * 3 * frame->width_Y * frame->height_Y, mean, std, bgr);
+}
+
+
+
+/**
+ * Frame buffers are kept across format changes while they are large enough,
+ * so their capacity only grows. Trimming releases all buffers that are not in
+ * use, and lowers the capacity to the current frame size once none is left.
+ * Macroblock arrays kept by output-only frames for the next frames are freed
+ * too.
+ */
+int edge264_trim_buffers(Edge264Decoder *dec) {
+	if (dec == NULL)
+		return EINVAL;
+	if (dec->n_threads)
+		pthread_mutex_lock(&dec->lock);
+	unsigned used = dec->reference_flags | dec->output_flags | dec->borrow_flags | depended_frames(dec);
+	if (dec->currPic >= 0)
+		used |= 1 << dec->currPic;
+	if (dec->basePic >= 0)
+		used |= 1 << dec->basePic;
+	unsigned idle = idle_mbs(dec);
+	unsigned allocated = 0;
+	for (int i = 0; i < 32; i++) {
+		if (dec->frame_buffers[i] != NULL && !(used & 1 << i)) {
+			free_frame(dec, i);
+		} else if (idle & 1 << i) {
+			free(dec->frame_mbs[i]);
+			dec->frame_mbs[i] = NULL;
+		}
+		allocated |= (dec->frame_buffers[i] != NULL) << i;
+	}
+	if (!allocated)
+		dec->frame_capacity = dec->frame_size;
+	if (dec->n_threads)
+		pthread_mutex_unlock(&dec->lock);
+	return 0;
+}
+
+
+
 void edge264_return_frame(Edge264Decoder *d, void *return_arg) {
 	if (d != NULL)
 		d->borrow_flags &= ~(size_t)return_arg;
@@ -448,6 +1006,19 @@ void edge264_return_frame(Edge264Decoder *d, void *return_arg) {
 
 
 
+int edge264_get_stats(Edge264Decoder *dec, Edge264Stats *out) {
+	if (dec == NULL || out == NULL)
+		return EINVAL;
+	if (dec->n_threads)
+		pthread_mutex_lock(&dec->lock);
+	*out = dec->stats;
+	if (dec->n_threads)
+		pthread_mutex_unlock(&dec->lock);
+	return 0;
+}
+
+
+
 const int8_t cabac_context_init[4][1024][2] __attribute__((aligned(16))) = {{
 	{  20, -15}, {   2,  54}, {   3,  74}, {  20, -15}, {   2,  54}, {   3,  74},
 	{ -28, 127}, { -23, 104}, {  -6,  53}, {  -1,  54}, {   7,  51}, {   0,   0},
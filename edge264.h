@@ -29,6 +29,7 @@
 #define edge264_H
 
 #include <errno.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -36,9 +37,31 @@ extern "C" {
 #endif
 
 typedef struct Edge264Decoder Edge264Decoder;
+typedef struct Edge264Pool Edge264Pool;
+
+typedef struct Edge264MbInfo {
+   int16_t mvs[2][16][2]; // [LX][luma4x4BlkIdx][x/y] motion vectors in quarter samples
+   int8_t Intra4x4PredMode[16]; // [luma4x4BlkIdx] for I_NxN mbs (replicated for each 8x8 block with transform_size_8x8_flag)
+   int8_t refIdx[2][4]; // [LX][mbPartIdx] for each 8x8 block, -1 if unused
+   uint8_t QP[3]; // QP'Y, QP'Cb and QP'Cr
+   int8_t mbIsInterFlag;
+   int8_t mb_skip_flag;
+   int8_t mb_type_I_NxN; // 1 for Intra4x4/Intra8x8 mbs, 0 for Intra16x16/I_PCM or inter mbs
+   int8_t transform_size_8x8_flag;
+   int8_t reserved;
+} Edge264MbInfo;
+
+#define EDGE264_MB_INTER 1 // bits in mb_type_map
+#define EDGE264_MB_SKIP 2
+#define EDGE264_MB_I_NxN 4
+#define EDGE264_MB_TRANSFORM_8x8 8
+#define EDGE264_MB_PART_16x16 0x00 // partitioning of motion in bits 4-5 for inter mbs
+#define EDGE264_MB_PART_16x8 0x10
+#define EDGE264_MB_PART_8x16 0x20
+#define EDGE264_MB_PART_8x8 0x30
 
 typedef struct Edge264Frame {
-   const uint8_t *samples[3]; // Y/Cb/Cr planes
+   const uint8_t *samples[3]; // Y/Cb/Cr planes (Cb/Cr are NULL with edge264_set_luma_only)
    const uint8_t *samples_mvc[3]; // second view
    const uint8_t *mb_errors; // probabilities (0..100) for each macroblock to be erroneous, NULL if there are no errors, values are spaced by stride_mb in memory
    int8_t pixel_depth_Y; // 0 for 8-bit, 1 for 16-bit
@@ -53,20 +76,121 @@ typedef struct Edge264Frame {
    int32_t TopFieldOrderCnt;
    int32_t BottomFieldOrderCnt;
    int16_t frame_crop_offsets[4]; // {top,right,bottom,left}, useful to derive the original frame with 16x16 macroblocks
+   int8_t deadline_level; // degradation applied by edge264_set_frame_deadline when this frame was decoded (0 for none, 1 if non-ref frames are not deblocked, 2 if non-ref frames are dropped, 3 if non-IDR frames are dropped)
+   uint16_t pictures_dropped; // number of pictures dropped right before this one in decoding order
+   int8_t reference; // 1 if the frame was used for reference (nal_ref_idc != 0 in any field), 0 if disposable
+   int16_t width_mbs; // dimensions of the macroblock grid, including cropped areas
+   int16_t height_mbs;
+   const Edge264MbInfo *mb_info; // width_mbs * height_mbs values in raster order if exported with edge264_set_mb_info_mode, NULL otherwise
+   const uint8_t *mb_qp_map; // QP'Y of each mb in raster order if exported with edge264_set_mb_maps, NULL otherwise
+   const uint8_t *mb_type_map; // EDGE264_MB_* bits of each mb
+   const uint16_t *mb_bits_map; // number of bits consumed by each mb in the bitstream
+   const uint8_t *samples_scaled[3]; // Y/Cb/Cr planes downscaled with edge264_set_output_scale, NULL otherwise
+   int8_t scale_shift; // log2 of the downscaling factor, such that scaled planes have width_Y >> scale_shift by height_Y >> scale_shift samples (same for chroma)
+   int16_t stride_scaled_Y;
+   int16_t stride_scaled_C;
+   const uint8_t *samples_converted[2]; // frame converted with edge264_set_output_format (Y and CbCr planes for NV12, single plane otherwise), NULL otherwise
+   int8_t output_format; // Edge264OutputFormat of samples_converted
+   int16_t stride_converted; // shared by both planes of NV12
+   int8_t video_full_range_flag; // from VUI, 0 if absent
+   uint8_t matrix_coefficients; // from VUI (Table E-5), 2 if unspecified
    void *return_arg;
 } Edge264Frame;
 
+typedef struct Edge264NalInfo {
+   int8_t nal_ref_idc;
+   int8_t nal_unit_type;
+   int8_t slice_type; // 0 for P, 1 for B, 2 for I, -1 if the NAL unit is not a slice
+   int8_t IdrPicFlag;
+   int8_t non_base_view; // 1 for MVC slices of the second view
+   int8_t new_picture; // 1 if the slice starts a new picture (first_mb_in_slice == 0 in the base view)
+   int16_t pic_parameter_set_id;
+   int32_t first_mb_in_slice;
+   int32_t frame_num; // value in the slice header
+   int32_t FrameNum; // frame_num with wraparounds removed
+   int32_t TopFieldOrderCnt;
+   int32_t BottomFieldOrderCnt;
+   int16_t width_Y; // cropped dimensions from the last SPS, 0 before any
+   int16_t height_Y;
+   int16_t width_mbs;
+   int16_t height_mbs;
+} Edge264NalInfo;
+
+typedef struct Edge264Stats {
+   uint32_t tasks_started; // number of slices picked for decoding by any thread
+   uint32_t tasks_reordered; // slices picked ahead of a ready one with a lower task index (first-come order)
+   uint32_t refs_prioritized; // slices of reference pictures picked while slices of non-reference pictures were ready
+   uint32_t deblocks_started; // batches of rows of mbs deblocked by separate deblocking tasks
+   uint32_t slices_skipped; // slices dropped without decoding because of the skip mode
+   uint32_t frames_hugetlb; // frame buffers allocated with explicit huge pages (MAP_HUGETLB)
+   uint32_t frames_thp; // frame buffers allocated with normal pages advised for transparent huge pages
+} Edge264Stats;
+
+typedef enum Edge264SkipMode {
+   EDGE264_SKIP_NONE, // decode all pictures
+   EDGE264_SKIP_NON_REF, // drop pictures with nal_ref_idc == 0
+   EDGE264_SKIP_NON_INTRA, // decode only pictures starting with an I slice
+   EDGE264_SKIP_NON_IDR, // decode only IDR pictures
+} Edge264SkipMode;
+
+typedef enum Edge264DeblockMode {
+   EDGE264_DEBLOCK_ALL, // apply the loop filter as signaled in slice headers
+   EDGE264_DEBLOCK_REF, // bypass it for pictures with nal_ref_idc == 0
+   EDGE264_DEBLOCK_NONE, // bypass it for all pictures
+} Edge264DeblockMode;
+
+typedef enum Edge264OutputFormat {
+   EDGE264_FORMAT_I420, // planar Y, Cb and Cr in samples only
+   EDGE264_FORMAT_NV12, // planar Y and interleaved CbCr
+   EDGE264_FORMAT_YUYV, // packed Y0 Cb Y1 Cr, with each chroma row used for 2 rows
+   EDGE264_FORMAT_RGB24, // packed R G B, converted with the matrix signaled in the SPS
+   EDGE264_FORMAT_BGR24, // packed B G R
+} Edge264OutputFormat;
+
+typedef enum Edge264PreallocMode {
+   EDGE264_PREALLOC_NONE, // allocate each frame buffer on its first use
+   EDGE264_PREALLOC_FAULT, // allocate all frame buffers when a SPS is activated, and touch all their pages
+   EDGE264_PREALLOC_LOCK, // same, and lock them in memory with mlock when permitted
+} Edge264PreallocMode;
+
+typedef enum Edge264MbInfoMode {
+   EDGE264_MB_INFO_NONE, // reconstruct frames without exporting macroblock info
+   EDGE264_MB_INFO_EXPORT, // reconstruct frames and export macroblock info
+   EDGE264_MB_INFO_ONLY, // parse frames to export macroblock info, without reconstructing samples
+} Edge264MbInfoMode;
+
 const uint8_t *edge264_find_start_code(const uint8_t *buf, const uint8_t *end);
+Edge264Pool *edge264_pool_alloc(int n_threads);
+void edge264_pool_free(Edge264Pool **ppool);
 #if EDGE264_TRACE
-Edge264Decoder *edge264_alloc(int n_threads, FILE *trace_headers, FILE *trace_slices);
+Edge264Decoder *edge264_alloc(int n_threads, Edge264Pool *pool, void *(*alloc_cb)(void *alloc_arg, size_t size), void (*dealloc_cb)(void *alloc_arg, void *ptr), void *alloc_arg, FILE *trace_headers, FILE *trace_slices);
 #else
-Edge264Decoder *edge264_alloc(int n_threads);
+Edge264Decoder *edge264_alloc(int n_threads, Edge264Pool *pool, void *(*alloc_cb)(void *alloc_arg, size_t size), void (*dealloc_cb)(void *alloc_arg, void *ptr), void *alloc_arg);
 #endif
+Edge264Decoder *edge264_probe_alloc(void);
 void edge264_flush(Edge264Decoder *dec);
 void edge264_free(Edge264Decoder **pdec);
 int edge264_decode_NAL(Edge264Decoder *dec, const uint8_t *buf, const uint8_t *end, int non_blocking, void (*free_cb)(void *free_arg, int ret), void *free_arg, const uint8_t **next_NAL);
+int edge264_decode_AVCC(Edge264Decoder *dec, const uint8_t *buf, const uint8_t *end, int length_size, int non_blocking, void (*free_cb)(void *free_arg, int ret), void *free_arg, const uint8_t **next_NAL);
+int edge264_decode_avcC(Edge264Decoder *dec, const uint8_t *buf, const uint8_t *end, int *length_size);
+int edge264_probe_NAL(Edge264Decoder *dec, const uint8_t *buf, const uint8_t *end, Edge264NalInfo *info, const uint8_t **next_NAL);
+int edge264_decode_chunk(Edge264Decoder *dec, const uint8_t *buf, const uint8_t *end, int non_blocking, const uint8_t **next_byte);
 int edge264_get_frame(Edge264Decoder *dec, Edge264Frame *out, int borrow);
+int edge264_set_output_cb(Edge264Decoder *dec, void (*output_cb)(void *output_arg, const Edge264Frame *frame), void *output_arg, int borrow);
+int edge264_set_skip_mode(Edge264Decoder *dec, Edge264SkipMode mode);
+int edge264_set_deblock_mode(Edge264Decoder *dec, Edge264DeblockMode mode);
+int edge264_set_frame_deadline(Edge264Decoder *dec, int64_t frame_period_ns);
+int edge264_set_mb_info_mode(Edge264Decoder *dec, Edge264MbInfoMode mode);
+int edge264_set_mb_maps(Edge264Decoder *dec, int enable);
+int edge264_set_prealloc_mode(Edge264Decoder *dec, Edge264PreallocMode mode);
+int edge264_set_huge_pages(Edge264Decoder *dec, int enable);
+int edge264_set_luma_only(Edge264Decoder *dec, int enable);
+int edge264_set_output_scale(Edge264Decoder *dec, int shift);
+int edge264_set_output_format(Edge264Decoder *dec, Edge264OutputFormat format);
+int edge264_convert_tensor(Edge264Decoder *dec, const Edge264Frame *frame, float *tensor, int index, const float *mean, const float *std, int bgr);
+int edge264_trim_buffers(Edge264Decoder *dec);
 void edge264_return_frame(Edge264Decoder *dec, void *return_arg);
+int edge264_get_stats(Edge264Decoder *dec, Edge264Stats *out);
 
 #ifdef __cplusplus
 }
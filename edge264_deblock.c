@@ -868,7 +868,8 @@ static void deblock_Y_8bit(Edge264Context *ctx) {
 	*(i8x16 *)PX(0, 15) = hF;
 	
 	// jump to chroma deblocking filter
-	deblock_CbCr_8bit(ctx);
+	if (!ctx->t.luma_only)
+		deblock_CbCr_8bit(ctx);
 }
 
 
@@ -924,11 +925,11 @@ static noinline void deblock_mb(Edge264Context *ctx)
 	i8x16 qPav = avgu8(qP, ziplo64(qP, qPAB)); // mid/mid/A/B
 	i8x16 c51 = set8(51);
 	#if defined(__SSE2__)
-		i8x16 indexA = minu8(max8(qPav + set8(ctx->t.FilterOffsetA), zero), c51);
-		i8x16 indexB = minu8(max8(qPav + set8(ctx->t.FilterOffsetB), zero), c51);
+		i8x16 indexA = minu8(max8(qPav + set8(mb->FilterOffsetA), zero), c51);
+		i8x16 indexB = minu8(max8(qPav + set8(mb->FilterOffsetB), zero), c51);
 	#elif defined(__ARM_NEON)
-		i8x16 indexA = minu8(vsqaddq_u8(qPav, set8(ctx->t.FilterOffsetA)), c51);
-		i8x16 indexB = minu8(vsqaddq_u8(qPav, set8(ctx->t.FilterOffsetB)), c51);
+		i8x16 indexA = minu8(vsqaddq_u8(qPav, set8(mb->FilterOffsetA)), c51);
+		i8x16 indexB = minu8(vsqaddq_u8(qPav, set8(mb->FilterOffsetB)), c51);
 	#endif
 	i8x16 c4 = set8(4);
 	i8x16 Am4 = subu8(indexA, c4);
@@ -1072,7 +1073,7 @@ static noinline void deblock_mb(Edge264Context *ctx)
 		
 		// for 8x8 blocks with CAVLC, broadcast transform tokens beforehand
 		i8x16 nC = mb->nC_v[0];
-		if (!ctx->t.pps.entropy_coding_mode_flag && mb->f.transform_size_8x8_flag) {
+		if (!mb->entropy_coding_mode_flag && mb->f.transform_size_8x8_flag) {
 			mb->nC_v[0] = nC = (i8x16)((i32x4)nC == 0) - -1;
 		}
 		
@@ -6,6 +6,7 @@
 #include "edge264_intra.c"
 #include "edge264_mvpred.c"
 #include "edge264_residual.c"
+#include "edge264_output.c"
 #define CABAC 0
 #include "edge264_slice.c"
 #define CABAC 1
@@ -54,8 +55,10 @@ static void initialize_context(Edge264Context *ctx, int currPic)
 	ctx->samples_mb[0] = ctx->t.samples_base + (ctx->mbx + ctx->mby * ctx->t.stride[0]) * 16;
 	ctx->samples_mb[1] = ctx->t.samples_base + ctx->t.plane_size_Y + (ctx->mbx + ctx->mby * ctx->t.stride[1]) * 8;
 	ctx->samples_mb[2] = ctx->samples_mb[1] + (ctx->t.stride[1] >> 1);
-	int mb_offset = ctx->t.plane_size_Y + ctx->t.plane_size_C + sizeof(Edge264Macroblock) * (ctx->mbx + ctx->mby * (ctx->t.pic_width_in_mbs + 1));
-	ctx->mbCol = ctx->_mb = (Edge264Macroblock *)(ctx->t.samples_base + mb_offset);
+	int mb_offset = ctx->mbx + ctx->mby * (ctx->t.pic_width_in_mbs + 1);
+	ctx->mbCol = ctx->_mb = ctx->t.mbs_base + mb_offset;
+	int ring = ctx->t.pic_width_in_mbs + 3;
+	ctx->_mbp = ctx->mbp_ring + ring + (ctx->mbx + ctx->mby * (ctx->t.pic_width_in_mbs + 1)) % ring;
 	ctx->A4x4_int8_v = (i16x16){0, 0, 2, 2, 1, 4, 3, 6, 8, 8, 10, 10, 9, 12, 11, 14};
 	ctx->B4x4_int8_v = (i32x16){0, 1, 0, 1, 4, 5, 4, 5, 2, 3, 8, 9, 6, 7, 12, 13};
 	if (ctx->t.ChromaArrayType == 1) {
@@ -96,7 +99,7 @@ static void initialize_context(Edge264Context *ctx, int currPic)
 		
 		// B slides
 		if (ctx->t.slice_type == 1) {
-			ctx->mbCol = (Edge264Macroblock *)(ctx->t.frame_buffers[ctx->t.RefPicList[1][0]] + mb_offset);
+			ctx->mbCol = ctx->t.mbs_col + mb_offset;
 			ctx->col_short_term = 1 & ~(ctx->t.long_term_flags >> ctx->t.RefPicList[1][0]);
 			
 			// initializations for temporal prediction and implicit weights
@@ -169,9 +172,9 @@ static void recover_slice(Edge264Context *ctx, int currPic) {
 	ctx->samples_mb[0] = ctx->t.samples_base + (ctx->mbx + ctx->mby * ctx->t.stride[0]) * 16;
 	ctx->samples_mb[1] = ctx->t.samples_base + ctx->t.plane_size_Y + (ctx->mbx + ctx->mby * ctx->t.stride[1]) * 8;
 	ctx->samples_mb[2] = ctx->samples_mb[1] + (ctx->t.stride[1] >> 1);
-	int mb_offset = ctx->t.plane_size_Y + ctx->t.plane_size_C + sizeof(Edge264Macroblock) * (ctx->mbx + ctx->mby * (ctx->t.pic_width_in_mbs + 1));
-	ctx->_mb = (Edge264Macroblock *)(ctx->t.samples_base + mb_offset);
-	ctx->mbCol = (Edge264Macroblock *)(ctx->t.frame_buffers[ctx->t.RefPicList[1][0]] + mb_offset);
+	int mb_offset = ctx->mbx + ctx->mby * (ctx->t.pic_width_in_mbs + 1);
+	ctx->_mb = ctx->t.mbs_base + mb_offset;
+	ctx->mbCol = ctx->t.mbs_col + mb_offset;
 	unsigned num = ctx->CurrMbAddr - ctx->t.first_mb_in_slice;
 	unsigned div = 65536 - ppow(65194, num);
 	for (unsigned i = 0; i < num; i++) {
@@ -222,7 +225,7 @@ static void recover_slice(Edge264Context *ctx, int currPic) {
 			*(i8x16 *)P(0, 13) = maddshr8(*(i8x16 *)P(0, 13), dcY, w8, w16, o, wd64, wd16);
 			*(i8x16 *)P(0, 14) = maddshr8(*(i8x16 *)P(0, 14), dcY, w8, w16, o, wd64, wd16);
 			*(i8x16 *)P(0, 15) = maddshr8(*(i8x16 *)P(0, 15), dcY, w8, w16, o, wd64, wd16);
-			{
+			if (!ctx->t.luma_only) {
 				uint8_t * restrict p = ctx->samples_mb[1];
 				size_t stride = ctx->t.stride[1] >> 1;
 				INIT_P();
@@ -301,145 +304,658 @@ static void recover_frame(Edge264Decoder *dec) {
 
 
 /**
- * This function is the entry point for each worker thread, where it consumes
- * tasks continuously until killed by the parent process.
+ * Publishes the deblocking progress of a frame at the end of each row of mbs,
+ * waking up the threads waiting on it and the tasks that may start with it.
+ * With separate deblocking the address is that of the next mb to decode, and
+ * it is published only if all mbs before the slice are decoded.
  */
-void *ADD_VARIANT(worker_loop)(Edge264Decoder *dec) {
+static noinline void signal_progress(Edge264Context *ctx, int next_addr) {
+	Edge264Decoder *dec = ctx->d;
+	int i = ctx->t.next_deblock_idc;
+	if (!ctx->t.deblock_separately && (dec->convert_flags & 1 << i))
+		convert_rows(dec, i, next_addr);
+	if (!ctx->n_threads) {
+		dec->next_deblock_addr[i] = next_addr;
+		return;
+	}
+	pthread_mutex_lock(&dec->lock);
+	if (!ctx->t.deblock_separately) {
+		__atomic_store_n(&dec->next_deblock_addr[i], next_addr, __ATOMIC_RELEASE);
+		pthread_cond_broadcast(&dec->task_progress);
+	} else if (dec->next_decode_addr[i] >= (int)ctx->t.first_mb_in_slice) {
+		dec->next_decode_addr[i] = max(dec->next_decode_addr[i], next_addr);
+	}
+	if (dec->pending_tasks && publish_ready_tasks(dec))
+		signal_ready_tasks(dec);
+	pthread_mutex_unlock(&dec->lock);
+}
+
+
+
+/**
+ * Waits until all rows of reference frames reachable from the current row of
+ * mbs have been deblocked. Vertical mvs are assumed to stay within the range
+ * of the level (A.3.1), so non-conforming streams may read unfinished samples.
+ */
+static noinline void wait_ref_progress(Edge264Context *ctx) {
+	Edge264Decoder *dec = ctx->d;
+	int needed = ref_progress_needed(&ctx->t, ctx->mby);
+	if (ctx->ref_frames & ~progressed_frames(dec, needed)) {
+		pthread_mutex_lock(&dec->lock);
+		while (ctx->ref_frames & ~progressed_frames(dec, needed))
+			pthread_cond_wait(&dec->task_progress, &dec->lock);
+		pthread_mutex_unlock(&dec->lock);
+	}
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+}
+
+
+
+/**
+ * Picks the most urgent ready task for output: deblocking and reconstruction
+ * tasks first (since they gate the completion of frames), then slices of reference pictures
+ * (since all later tasks may depend on them), then lowest (POC epoch, POC),
+ * then lowest first_mb_in_slice.
+ */
+static int select_task(Edge264Decoder *dec) {
+	uint64_t ready = dec->ready_tasks;
+	uint64_t candidates = (ready & (dec->deblock_tasks | dec->recon_tasks)) ?: (ready & dec->reference_tasks) ?: ready;
+	int task_id = ctz64(candidates);
+	int pic = dec->taskPics[task_id];
+	for (uint64_t c = candidates & (candidates - 1); c; c &= c - 1) {
+		int i = ctz64(c);
+		int j = dec->taskPics[i];
+		int epochs = dec->FrameEpochs[j] - dec->FrameEpochs[pic]; // wraps safely
+		int pocs = dec->FieldOrderCnt[0][j] - dec->FieldOrderCnt[0][pic];
+		if (epochs < 0 || (epochs == 0 && (pocs < 0 ||
+		    (pocs == 0 && dec->tasks[i].first_mb_in_slice < dec->tasks[task_id].first_mb_in_slice)))) {
+			task_id = i;
+			pic = j;
+		}
+	}
+	if (dec->recon_tasks & (uint64_t)1 << task_id) {
+		return task_id;
+	} else if (candidates & dec->deblock_tasks) {
+		dec->stats.deblocks_started++;
+	} else {
+		dec->stats.tasks_started++;
+		dec->stats.tasks_reordered += task_id != ctz64(ready);
+		dec->stats.refs_prioritized += (ready & ~dec->reference_tasks) && candidates != ready;
+	}
+	return task_id;
+}
+
+
+
+/**
+ * Deblocks all mbs from ctx->t.next_deblock_addr up to end (excluded).
+ */
+static void deblock_until(Edge264Context *ctx, int end) {
+	if (ctx->t.next_deblock_addr >= end)
+		return;
+	ctx->mby = (unsigned)ctx->t.next_deblock_addr / (unsigned)ctx->t.pic_width_in_mbs;
+	ctx->mbx = (unsigned)ctx->t.next_deblock_addr % (unsigned)ctx->t.pic_width_in_mbs;
+	ctx->samples_mb[0] = ctx->t.samples_base + (ctx->mbx + ctx->mby * ctx->t.stride[0]) * 16;
+	ctx->samples_mb[1] = ctx->t.samples_base + ctx->t.plane_size_Y + (ctx->mbx + ctx->mby * ctx->t.stride[1]) * 8;
+	ctx->samples_mb[2] = ctx->samples_mb[1] + (ctx->t.stride[1] >> 1);
+	ctx->_mb = ctx->t.mbs_base + ctx->mbx + ctx->mby * (ctx->t.pic_width_in_mbs + 1);
+	while (ctx->t.next_deblock_addr < end) {
+		deblock_mb(ctx);
+		ctx->t.next_deblock_addr++;
+		ctx->_mb++;
+		ctx->mbx++;
+		ctx->samples_mb[0] += 16;
+		ctx->samples_mb[1] += 8;
+		ctx->samples_mb[2] += 8;
+		if (ctx->mbx >= ctx->t.pic_width_in_mbs) {
+			ctx->_mb++;
+			ctx->mbx = 0;
+			ctx->samples_mb[0] += ctx->t.stride[0] * 16 - ctx->t.pic_width_in_mbs * 16;
+			ctx->samples_mb[1] += ctx->t.stride[1] * 8 - ctx->t.pic_width_in_mbs * 8;
+			ctx->samples_mb[2] += ctx->t.stride[1] * 8 - ctx->t.pic_width_in_mbs * 8;
+		}
+	}
+}
+
+
+
+/**
+ * By default all frames with POC lower or equal with the last non-reference
+ * picture or lower than the last IDR picture are considered for output.
+ * This function will consider all frames instead if either:
+ * _ there are more frames to output than max_num_reorder_frames
+ * _ there is no empty slot for the next frame
+ */
+static int pop_frame(Edge264Decoder *dec, Edge264Frame *out, int borrow) {
+	int pic[2] = {-1, -1};
+	unsigned refs = dec->reference_flags;
+	if (dec->currPic >= 0) {
+		// the marking of the current picture may release a slot before finish_frame applies it
+		unsigned other_views = -dec->sps.mvc & 0xaaaaaaaa >> (dec->sps.mvc & dec->currPic & 1);
+		refs = (refs & other_views) | dec->pic_reference_flags;
+	}
+	unsigned unavail = refs | dec->output_flags | (dec->basePic < 0 ? 0 : 1 << dec->basePic);
+	int best = (__builtin_popcount(dec->output_flags) > dec->sps.max_num_reorder_frames ||
+		__builtin_popcount(unavail) >= dec->sps.num_frame_buffers) ? INT_MAX : dec->dispPicOrderCnt;
+	for (int o = dec->output_flags; o != 0; o &= o - 1) {
+		int i = __builtin_ctz(o);
+		if (dec->FieldOrderCnt[0][i] <= best) {
+			int non_base = dec->sps.mvc & i & 1;
+			if (dec->FieldOrderCnt[0][i] < best) {
+				best = dec->FieldOrderCnt[0][i];
+				pic[non_base ^ 1] = -1;
+			}
+			pic[non_base] = i;
+		}
+	}
+	
+	int res = ENOMSG;
+	if (pic[0] >= 0 && dec->next_deblock_addr[pic[0]] == INT_MAX && (pic[1] < 0 || dec->next_deblock_addr[pic[1]] == INT_MAX)) {
+		*out = dec->out;
+		int top = dec->out.frame_crop_offsets[0];
+		int left = dec->out.frame_crop_offsets[3];
+		int offY = top * dec->out.stride_Y + (left << dec->out.pixel_depth_Y);
+		int topC = dec->sps.chroma_format_idc == 3 ? top : top >> 1;
+		int leftC = dec->sps.chroma_format_idc == 1 ? left >> 1 : left;
+		int offC = dec->plane_size_Y + topC * dec->out.stride_C + (leftC << dec->out.pixel_depth_C);
+		dec->output_flags ^= 1 << pic[0];
+		const uint8_t *samples = dec->frame_buffers[pic[0]];
+		out->samples[0] = samples + offY;
+		out->samples[1] = samples + offC;
+		out->samples[2] = samples + (dec->out.stride_C >> 1) + offC;
+		out->TopFieldOrderCnt = best << 6 >> 6;
+		out->BottomFieldOrderCnt = dec->FieldOrderCnt[1][pic[0]] << 6 >> 6;
+		out->return_arg = (void *)((size_t)1 << pic[0]);
+		out->deadline_level = dec->frame_deadline_levels[pic[0]];
+		out->pictures_dropped = dec->frame_pictures_dropped[pic[0]];
+		out->reference = dec->frame_ref_flags >> pic[0] & 1;
+		out->mb_info = (dec->mb_info_flags & 1 << pic[0]) ? dec->mb_infos[pic[0]] : NULL;
+		out->mb_qp_map = out->mb_type_map = NULL;
+		out->mb_bits_map = NULL;
+		if (dec->mb_maps_flags & 1 << pic[0]) {
+			int mbs = dec->out.width_mbs * dec->out.height_mbs;
+			out->mb_qp_map = dec->mb_maps[pic[0]];
+			out->mb_type_map = dec->mb_maps[pic[0]] + mbs;
+			out->mb_bits_map = (uint16_t *)(dec->mb_maps[pic[0]] + mbs * 2);
+		}
+		if (dec->parse_only_flags & 1 << pic[0])
+			out->samples[0] = out->samples[1] = out->samples[2] = NULL;
+		if (pic[1] >= 0) {
+			dec->output_flags ^= 1 << pic[1];
+			samples = dec->frame_buffers[pic[1]];
+			out->samples_mvc[0] = samples + offY;
+			out->samples_mvc[1] = samples + offC;
+			out->samples_mvc[2] = samples + (dec->out.stride_C >> 1) + offC;
+			out->return_arg = (void *)((size_t)1 << pic[0] | (size_t)1 << pic[1]);
+		}
+		if (dec->plane_size_C == 0) // luma-only frames
+			out->samples[1] = out->samples[2] = out->samples_mvc[1] = out->samples_mvc[2] = NULL;
+		out->samples_scaled[0] = out->samples_scaled[1] = out->samples_scaled[2] = NULL;
+		out->scale_shift = 0;
+		out->stride_scaled_Y = out->stride_scaled_C = 0;
+		if (dec->frame_scale_shifts[pic[0]] > 0) {
+			int shift = out->scale_shift = dec->frame_scale_shifts[pic[0]];
+			const uint8_t *scaled = dec->scaled_buffers[pic[0]];
+			out->stride_scaled_Y = scaled_stride_Y(dec, shift);
+			out->stride_scaled_C = scaled_stride_C(dec, shift);
+			out->samples_scaled[0] = scaled + (top >> shift) * out->stride_scaled_Y + (left >> shift);
+			if (dec->plane_size_C > 0) {
+				const uint8_t *scaled_C = scaled + out->stride_scaled_Y * (dec->out.height_mbs * 16 >> shift) +
+					(topC >> shift) * out->stride_scaled_C + (leftC >> shift);
+				out->samples_scaled[1] = scaled_C;
+				out->samples_scaled[2] = scaled_C + out->stride_scaled_C / 2;
+			}
+		}
+		out->samples_converted[0] = out->samples_converted[1] = NULL;
+		out->output_format = dec->frame_output_formats[pic[0]];
+		out->stride_converted = 0;
+		if (out->output_format != EDGE264_FORMAT_I420) {
+			const uint8_t *converted = dec->converted_buffers[pic[0]];
+			out->stride_converted = converted_stride(dec, out->output_format);
+			if (out->output_format == EDGE264_FORMAT_NV12) {
+				out->samples_converted[0] = converted + top * out->stride_converted + left;
+				out->samples_converted[1] = converted + out->stride_converted * (dec->out.height_mbs * 16 + (top >> 1)) + left;
+			} else {
+				out->samples_converted[0] = converted + top * out->stride_converted + left * (out->output_format == EDGE264_FORMAT_YUYV ? 2 : 3);
+			}
+		}
+		res = 0;
+		if (borrow)
+			dec->borrow_flags |= (size_t)out->return_arg;
+	}
+	return res;
+}
+
+/**
+ * Passes all frames ready for output to the output callback, if any. It is
+ * called with dec->lock held whenever a frame completes or output rules may
+ * have changed, so frames reach the caller without polling edge264_get_frame.
+ */
+static void output_frames(Edge264Decoder *dec) {
+	Edge264Frame out;
+	while (dec->output_cb != NULL && pop_frame(dec, &out, dec->output_borrow) == 0)
+		dec->output_cb(dec->output_arg, &out);
+}
+
+
+
+/**
+ * Deblocks the rows of a frame decoded since the last run of its deblocking
+ * task, which is then put back to pending until the end of frame, or released
+ * if no slice remains to decode more of the frame. Like decode_task, it is
+ * called with dec->lock held.
+ */
+static int deblock_task(Edge264Decoder *dec, int task_id) {
 	Edge264Context c;
 	c.d = dec;
 	c.n_threads = dec->n_threads;
 	#if EDGE264_TRACE
 	c.trace_slices = dec->trace_slices;
 	#endif
-	if (c.n_threads)
-		pthread_mutex_lock(&dec->lock);
-	for (;;) {
-		while (c.n_threads && !dec->ready_tasks)
-			pthread_cond_wait(&dec->task_ready, &dec->lock);
-		int task_id = __builtin_ctz(dec->ready_tasks); // FIXME arbitrary selection for now
-		int currPic = dec->taskPics[task_id];
-		dec->pending_tasks &= ~(1 << task_id);
-		dec->ready_tasks &= ~(1 << task_id);
-		if (c.n_threads) {
-			pthread_mutex_unlock(&dec->lock);
-			print_header(dec, "<h>Thread started decoding frame %d at macroblock %d</h>\n", dec->FieldOrderCnt[0][dec->taskPics[task_id]], dec->tasks[task_id].first_mb_in_slice);
-		}
-		c.t = dec->tasks[task_id];
-		initialize_context(&c, currPic);
-		size_t ret = 0;
-		if (!c.t.pps.entropy_coding_mode_flag) {
-			c.mb_skip_run = -1;
-			parse_slice_data_cavlc(&c);
-			// FIXME detect and signal error
-		} else {
-			// cabac_alignment_one_bit gives a good probability to catch random errors.
-			if (cabac_start(&c)) {
-				ret = EBADMSG; // FIXME error_flag
-			} else {
-				cabac_init(&c);
-				c.mb_qp_delta_nz = 0;
-				parse_slice_data_cabac(&c);
-				// the possibility of cabac_zero_word implies we should not expect a start code yet
-				if (c.t._gb.msb_cache != 0 || (c.t._gb.lsb_cache & (c.t._gb.lsb_cache - 1))) {
-					ret = EBADMSG; // FIXME error_flag
-				}
+	int currPic = dec->taskPics[task_id];
+	dec->pending_tasks &= ~((uint64_t)1 << task_id);
+	__atomic_and_fetch(&dec->ready_tasks, ~((uint64_t)1 << task_id), __ATOMIC_RELEASE);
+	c.t = dec->tasks[task_id];
+	c.t.next_deblock_addr = dec->next_deblock_addr[currPic];
+	int end = max(deblock_limit(dec, &c.t, currPic), c.t.next_deblock_addr);
+	pthread_mutex_unlock(&dec->lock);
+	print_header(dec, "<h>Thread started deblocking frame %d at macroblock %d</h>\n", dec->FieldOrderCnt[0][currPic], c.t.next_deblock_addr);
+	deblock_until(&c, end);
+	if (dec->convert_flags & 1 << currPic)
+		convert_rows(dec, currPic, end);
+	
+	pthread_mutex_lock(&dec->lock);
+	int complete = end == c.t.pic_width_in_mbs * c.t.pic_height_in_mbs;
+	__atomic_store_n(&dec->next_deblock_addr[currPic], complete ? INT_MAX : end, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&dec->task_progress);
+	if (complete)
+		output_frames(dec);
+	if (!complete && ((frame_tasks(dec, currPic) & ~dec->deblock_tasks) || deblock_limit(dec, &c.t, currPic) > end)) {
+		dec->pending_tasks |= (uint64_t)1 << task_id;
+	} else {
+		pthread_cond_signal(&dec->task_complete);
+		dec->busy_tasks &= ~((uint64_t)1 << task_id);
+		dec->reference_tasks &= ~((uint64_t)1 << task_id);
+		dec->deblock_tasks &= ~((uint64_t)1 << task_id);
+		dec->taskPics[task_id] = -1;
+	}
+	if (publish_ready_tasks(dec))
+		signal_ready_tasks(dec);
+	return 0;
+}
+
+
+
+/**
+ * Replays the ops recorded for a row of mbs in a pipelined slice. The
+ * progress of each row is published after each mb, and each mb waits for its
+ * upper-right neighbour to be reconstructed, such that rows progress in
+ * wavefront order. Threads block on dec->task_progress only when the row
+ * above lags behind, and are woken if p->waiters is set.
+ */
+static void replay_recon_ops(Edge264Context *ctx, const Edge264ReconOp *o, int32_t *above, int32_t *progress) {
+	Edge264Pipeline *p = &ctx->d->pipe;
+	for (;; o++) {
+		switch (o->op) {
+		case OP_MB:
+			ctx->mbx = o->dc & 0xffff;
+			ctx->mby = o->dc >> 16;
+			__atomic_store_n(progress, ctx->mbx, __ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&p->waiters, __ATOMIC_SEQ_CST)) {
+				pthread_mutex_lock(&ctx->d->lock);
+				pthread_cond_broadcast(&ctx->d->task_progress);
+				pthread_mutex_unlock(&ctx->d->lock);
 			}
-		}
-		
-		// deblock the rest of mbs in this slice
-		if (c.t.next_deblock_addr >= 0) {
-			c.t.next_deblock_addr = max(c.t.next_deblock_addr, c.t.first_mb_in_slice);
-			c.mby = (unsigned)c.t.next_deblock_addr / (unsigned)c.t.pic_width_in_mbs;
-			c.mbx = (unsigned)c.t.next_deblock_addr % (unsigned)c.t.pic_width_in_mbs;
-			c.samples_mb[0] = c.t.samples_base + (c.mbx + c.mby * c.t.stride[0]) * 16;
-			c.samples_mb[1] = c.t.samples_base + c.t.plane_size_Y + (c.mbx + c.mby * c.t.stride[1]) * 8;
-			c.samples_mb[2] = c.samples_mb[1] + (c.t.stride[1] >> 1);
-			c._mb = (Edge264Macroblock *)(c.t.samples_base + c.t.plane_size_Y + c.t.plane_size_C) + c.mbx + c.mby * (c.t.pic_width_in_mbs + 1);
-			while (c.t.next_deblock_addr < c.CurrMbAddr) {
-				deblock_mb(&c);
-				c.t.next_deblock_addr++;
-				c._mb++;
-				c.mbx++;
-				c.samples_mb[0] += 16;
-				c.samples_mb[1] += 8;
-				c.samples_mb[2] += 8;
-				if (c.mbx >= c.t.pic_width_in_mbs) {
-					c._mb++;
-					c.mbx = 0;
-					c.samples_mb[0] += c.t.stride[0] * 16 - c.t.pic_width_in_mbs * 16;
-					c.samples_mb[1] += c.t.stride[1] * 8 - c.t.pic_width_in_mbs * 8;
-					c.samples_mb[2] += c.t.stride[1] * 8 - c.t.pic_width_in_mbs * 8;
-				}
+			int needed = min(ctx->mbx + 2, ctx->t.pic_width_in_mbs);
+			if (above != NULL && __atomic_load_n(above, __ATOMIC_ACQUIRE) < needed) {
+				pthread_mutex_lock(&ctx->d->lock);
+				__atomic_add_fetch(&p->waiters, 1, __ATOMIC_SEQ_CST);
+				while (__atomic_load_n(above, __ATOMIC_SEQ_CST) < needed)
+					pthread_cond_wait(&ctx->d->task_progress, &ctx->d->lock);
+				__atomic_sub_fetch(&p->waiters, 1, __ATOMIC_SEQ_CST);
+				pthread_mutex_unlock(&ctx->d->lock);
 			}
+			ctx->_mb = (Edge264Macroblock *)o->p;
+			ctx->samples_mb[0] = ctx->t.samples_base + (ctx->mbx + ctx->mby * ctx->t.stride[0]) * 16;
+			ctx->samples_mb[1] = ctx->t.samples_base + ctx->t.plane_size_Y + (ctx->mbx + ctx->mby * ctx->t.stride[1]) * 8;
+			ctx->samples_mb[2] = ctx->samples_mb[1] + (ctx->t.stride[1] >> 1);
+			break;
+		case OP_INTRA4x4:
+			decode_intra4x4(o->arg, o->p, ctx->t.stride[o->iYCbCr], ctx->t.samples_clip_v[o->iYCbCr]);
+			break;
+		case OP_INTRA8x8:
+			decode_intra8x8(o->arg, o->p, ctx->t.stride[o->iYCbCr], ctx->t.samples_clip_v[o->iYCbCr]);
+			break;
+		case OP_INTRA16x16:
+			decode_intra16x16(o->arg, o->p, ctx->t.stride[0], ctx->t.samples_clip_v[0]);
+			break;
+		case OP_INTRA_CHROMA:
+			decode_intraChroma(o->arg, o->p, ctx->t.stride[1] >> 1, ctx->t.samples_clip_v[1]);
+			break;
+		case OP_INTER:
+			decode_inter(ctx, o->arg, o->iYCbCr, o->qP);
+			break;
+		case OP_IDCT4x4:
+			ctx->t.QP[o->iYCbCr] = o->qP;
+			ctx->c[16 + (o->arg & 15)] = o->dc;
+			for (int i = 0; i < 4; i++)
+				ctx->c_v[i] = ((i32x4 *)(o + 1))[i];
+			add_idct4x4(ctx, o->iYCbCr, o->arg, o->p);
+			o += 4;
+			break;
+		case OP_DC4x4:
+			ctx->c[16 + o->arg] = o->dc;
+			add_dc4x4(ctx, o->iYCbCr, o->arg, o->p);
+			break;
+		case OP_IDCT8x8:
+			ctx->t.QP[o->iYCbCr] = o->qP;
+			for (int i = 0; i < 16; i++)
+				ctx->c_v[i] = ((i32x4 *)(o + 1))[i];
+			add_idct8x8(ctx, o->iYCbCr, o->p);
+			o += 16;
+			break;
+		default: // OP_END
+			pthread_mutex_lock(&ctx->d->lock);
+			__atomic_store_n(progress, ctx->t.pic_width_in_mbs, __ATOMIC_RELEASE);
+			pthread_cond_broadcast(&ctx->d->task_progress);
+			pthread_mutex_unlock(&ctx->d->lock);
+			return;
 		}
-		
-		// on error, recover mbs and signal them as erroneous (allows overwrite by redundant slices)
-		if (__builtin_expect(ret != 0, 0))
-			recover_slice(&c, currPic);
-		
-		// update dec->next_deblock_addr, considering it might have reached first_mb_in_slice since start
-		if (dec->next_deblock_addr[currPic] >= c.t.first_mb_in_slice &&
-		    !(c.t.disable_deblocking_filter_idc == 0 && c.t.next_deblock_addr < 0)) {
-			dec->next_deblock_addr[currPic] = c.CurrMbAddr;
-			pthread_cond_broadcast(&dec->task_progress);
-		}
-		
-		// deblock the rest of the frame if all mbs have been decoded correctly
-		int remaining_mbs = ret ?: __atomic_sub_fetch(&dec->remaining_mbs[currPic], c.CurrMbAddr - c.t.first_mb_in_slice, __ATOMIC_ACQ_REL);
-		if (remaining_mbs == 0) {
-			c.t.next_deblock_addr = dec->next_deblock_addr[currPic];
-			c.CurrMbAddr = c.t.pic_width_in_mbs * c.t.pic_height_in_mbs;
-			if ((unsigned)c.t.next_deblock_addr < c.CurrMbAddr) {
-				c.mby = (unsigned)c.t.next_deblock_addr / (unsigned)c.t.pic_width_in_mbs;
-				c.mbx = (unsigned)c.t.next_deblock_addr % (unsigned)c.t.pic_width_in_mbs;
-				c.samples_mb[0] = c.t.samples_base + (c.mbx + c.mby * c.t.stride[0]) * 16;
-				c.samples_mb[1] = c.t.samples_base + c.t.plane_size_Y + (c.mbx + c.mby * c.t.stride[1]) * 8;
-				c.samples_mb[2] = c.samples_mb[1] + (c.t.stride[1] >> 1);
-				c._mb = (Edge264Macroblock *)(c.t.samples_base + c.t.plane_size_Y + c.t.plane_size_C) + c.mbx + c.mby * (c.t.pic_width_in_mbs + 1);
-				while (c.t.next_deblock_addr < c.CurrMbAddr) {
-					deblock_mb(&c);
-					c.t.next_deblock_addr++;
-					c._mb++;
-					c.mbx++;
-					c.samples_mb[0] += 16;
-					c.samples_mb[1] += 8;
-					c.samples_mb[2] += 8;
-					if (c.mbx >= c.t.pic_width_in_mbs) {
-						c._mb++;
-						c.mbx = 0;
-						c.samples_mb[0] += c.t.stride[0] * 16 - c.t.pic_width_in_mbs * 16;
-						c.samples_mb[1] += c.t.stride[1] * 8 - c.t.pic_width_in_mbs * 8;
-						c.samples_mb[2] += c.t.stride[1] * 8 - c.t.pic_width_in_mbs * 8;
-					}
-				}
-			}
-			dec->next_deblock_addr[currPic] = INT_MAX; // signals the frame is complete
+	}
+}
+
+
+
+/**
+ * Claims the next row of the pipelined slice and reconstructs it, then
+ * publishes the rows reconstructed contiguously to the deblocking task. It is
+ * called with dec->lock held, which is released during reconstruction.
+ */
+static void reconstruct_row(Edge264Decoder *dec) {
+	Edge264Pipeline *p = &dec->pipe;
+	Edge264Context c;
+	c.d = dec;
+	c.n_threads = dec->n_threads;
+	c.recon_ops = NULL;
+	#if EDGE264_TRACE
+	c.trace_slices = dec->trace_slices;
+	#endif
+	int task_id = ctz64(dec->recon_tasks);
+	int currPic = dec->taskPics[task_id];
+	int n = p->rows_claimed++;
+	if (publish_ready_tasks(dec))
+		signal_ready_tasks(dec);
+	c.t = dec->tasks[task_id];
+	pthread_mutex_unlock(&dec->lock);
+	for (int i = 0; i < 32; i++) {
+		c.implicit_weights_v[i][0] = p->implicit_weights_v[i][0];
+		c.implicit_weights_v[i][1] = p->implicit_weights_v[i][1];
+	}
+	replay_recon_ops(&c, p->ops + n % RECON_ROWS * p->row_ops,
+		n > 0 ? p->progress + (n - 1) % RECON_ROWS : NULL, p->progress + n % RECON_ROWS);
+	
+	pthread_mutex_lock(&dec->lock);
+	p->done[n % RECON_ROWS] = 1;
+	while (p->rows_done < p->rows_claimed && p->done[p->rows_done % RECON_ROWS])
+		p->done[p->rows_done++ % RECON_ROWS] = 0;
+	int next_addr = min((p->first_row + p->rows_done) * c.t.pic_width_in_mbs, p->end_addr);
+	if (dec->next_decode_addr[currPic] >= (int)c.t.first_mb_in_slice)
+		dec->next_decode_addr[currPic] = max(dec->next_decode_addr[currPic], next_addr);
+	pthread_cond_broadcast(&dec->task_progress);
+	if (publish_ready_tasks(dec))
+		signal_ready_tasks(dec);
+}
+
+
+
+/**
+ * Reserves the reconstruction task for a slice about to be decoded, if it is
+ * worth pipelining and the ring of ops can hold its rows. Slices are pipelined
+ * only when some threads would otherwise stay idle, and only one at a time.
+ * MBAFF, field and 4:2:2/4:4:4 pictures are always reconstructed inline.
+ */
+static Edge264ReconOp *start_recon(Edge264Decoder *dec, int task_id) {
+	const Edge264Task *t = dec->tasks + task_id;
+	Edge264Pipeline *p = &dec->pipe;
+	uint64_t running = dec->busy_tasks & ~dec->pending_tasks;
+	if (!t->deblock_separately || t->parse_only || t->field_pic_flag || t->MbaffFrameFlag || t->ChromaArrayType > 1 ||
+	    dec->recon_tasks || popcount64(~dec->busy_tasks) < 3 || popcount64(running) + popcount64(dec->ready_tasks) >= dec->n_threads)
+		return NULL;
+	int row_ops = t->pic_width_in_mbs * RECON_OPS_PER_MB + 1;
+	if (p->row_ops < row_ops) {
+		free(p->ops);
+		p->row_ops = 0;
+		if (!(p->ops = malloc(row_ops * RECON_ROWS * sizeof(Edge264ReconOp))))
+			return NULL;
+		p->row_ops = row_ops;
+	}
+	int recon_id = 63 - clz64(~dec->busy_tasks); // leaves the lowest slots to a slice being parsed and its deblocking task
+	dec->tasks[recon_id] = *t;
+	dec->tasks[recon_id].free_cb = NULL;
+	dec->busy_tasks |= (uint64_t)1 << recon_id;
+	dec->pending_tasks |= (uint64_t)1 << recon_id;
+	dec->recon_tasks = (uint64_t)1 << recon_id;
+	dec->task_dependencies[recon_id] = 0;
+	dec->taskPics[recon_id] = dec->taskPics[task_id];
+	p->first_row = t->first_mb_in_slice / t->pic_width_in_mbs;
+	p->end_addr = INT_MAX;
+	p->rows_parsed = p->rows_claimed = p->rows_done = 0;
+	for (int i = 0; i < RECON_ROWS; i++)
+		p->done[i] = 0;
+	return p->ops;
+}
+
+
+
+/**
+ * Hands the row of ops just recorded to the reconstruction task, called with
+ * dec->lock held.
+ */
+static void end_recon_row(Edge264Context *ctx) {
+	Edge264Decoder *dec = ctx->d;
+	Edge264Pipeline *p = &dec->pipe;
+	int n = p->rows_parsed++;
+	ctx->recon_ops->op = OP_END;
+	p->progress[n % RECON_ROWS] = n > 0 ? 0 : ctx->t.first_mb_in_slice % ctx->t.pic_width_in_mbs;
+	if (publish_ready_tasks(dec))
+		signal_ready_tasks(dec);
+}
+
+
+
+/**
+ * Called by the entropy decoder of a pipelined slice at the end of each row of
+ * mbs. Before recording the next row, it waits for the ring to have a free
+ * row, which also requires the row below it to be done with its progress. In
+ * the meantime it reconstructs rows itself, such that pipelining progresses
+ * even when all other threads are busy.
+ */
+static noinline void publish_recon_row(Edge264Context *ctx) {
+	Edge264Decoder *dec = ctx->d;
+	Edge264Pipeline *p = &dec->pipe;
+	pthread_mutex_lock(&dec->lock);
+	end_recon_row(ctx);
+	while (p->rows_done < p->rows_parsed + 2 - RECON_ROWS) {
+		if (p->rows_claimed < p->rows_parsed)
+			reconstruct_row(dec);
+		else
+			pthread_cond_wait(&dec->task_progress, &dec->lock);
+	}
+	pthread_mutex_unlock(&dec->lock);
+	ctx->recon_ops = p->ops + p->rows_parsed % RECON_ROWS * p->row_ops;
+}
+
+
+
+/**
+ * Hands the last row of a pipelined slice and helps reconstructing all rows
+ * left, then releases the reconstruction task.
+ */
+static void finish_recon(Edge264Context *ctx) {
+	Edge264Decoder *dec = ctx->d;
+	Edge264Pipeline *p = &dec->pipe;
+	pthread_mutex_lock(&dec->lock);
+	p->end_addr = ctx->CurrMbAddr;
+	if (ctx->recon_ops != p->ops + p->rows_parsed % RECON_ROWS * p->row_ops)
+		end_recon_row(ctx);
+	while (p->rows_done < p->rows_parsed) {
+		if (p->rows_claimed < p->rows_parsed)
+			reconstruct_row(dec);
+		else
+			pthread_cond_wait(&dec->task_progress, &dec->lock);
+	}
+	int task_id = ctz64(dec->recon_tasks);
+	dec->busy_tasks &= ~((uint64_t)1 << task_id);
+	dec->pending_tasks &= ~((uint64_t)1 << task_id);
+	dec->reference_tasks &= ~((uint64_t)1 << task_id);
+	__atomic_and_fetch(&dec->ready_tasks, ~((uint64_t)1 << task_id), __ATOMIC_RELEASE);
+	dec->recon_tasks = 0;
+	dec->taskPics[task_id] = -1;
+	pthread_cond_signal(&dec->task_complete);
+	pthread_mutex_unlock(&dec->lock);
+	ctx->recon_ops = NULL;
+}
+
+
+
+/**
+ * Decodes the next ready task. When multithreaded it is called with dec->lock
+ * held, which is released during decoding and acquired again before return.
+ */
+int ADD_VARIANT(decode_task)(Edge264Decoder *dec) {
+	Edge264Context c;
+	c.d = dec;
+	c.n_threads = dec->n_threads;
+	#if EDGE264_TRACE
+	c.trace_slices = dec->trace_slices;
+	#endif
+	int task_id = select_task(dec);
+	if (dec->deblock_tasks & (uint64_t)1 << task_id)
+		return deblock_task(dec, task_id);
+	if (dec->recon_tasks & (uint64_t)1 << task_id) {
+		reconstruct_row(dec);
+		return 0;
+	}
+	int currPic = dec->taskPics[task_id];
+	dec->pending_tasks &= ~((uint64_t)1 << task_id);
+	__atomic_and_fetch(&dec->ready_tasks, ~((uint64_t)1 << task_id), __ATOMIC_RELEASE);
+	c.ref_frames = dec->task_dependencies[task_id];
+	c.recon_ops = NULL;
+	if (c.n_threads) {
+		// starting this task may allow those referencing currPic to start too
+		publish_ready_tasks(dec);
+		c.recon_ops = start_recon(dec, task_id);
+		if (dec->ready_tasks)
+			signal_ready_tasks(dec);
+		pthread_mutex_unlock(&dec->lock);
+		print_header(dec, "<h>Thread started decoding frame %d at macroblock %d</h>\n", dec->FieldOrderCnt[0][dec->taskPics[task_id]], dec->tasks[task_id].first_mb_in_slice);
+	}
+	c.t = dec->tasks[task_id];
+	c.mbp_ring = dec->mbp_rings + task_id * (c.t.pic_width_in_mbs + 3) * 2;
+	initialize_context(&c, currPic);
+	if (c.recon_ops) {
+		for (int i = 0; i < 32; i++) {
+			dec->pipe.implicit_weights_v[i][0] = c.implicit_weights_v[i][0];
+			dec->pipe.implicit_weights_v[i][1] = c.implicit_weights_v[i][1];
 		}
-		
-		// if multi-threaded, check if we are the last task to touch this frame and ensure it is complete
-		if (c.n_threads) {
-			pthread_mutex_lock(&dec->lock);
-			pthread_cond_signal(&dec->task_complete);
-			print_header(dec, "<h>Thread finished decoding frame %d at macroblock %d</h>\n", dec->FieldOrderCnt[0][currPic], c.t.first_mb_in_slice);
-			if (remaining_mbs == 0) {
-				pthread_cond_broadcast(&dec->task_progress);
-				dec->ready_tasks = ready_tasks(dec);
-				if (dec->ready_tasks)
-					pthread_cond_broadcast(&dec->task_ready);
+	}
+	size_t ret = 0;
+	if (!c.t.pps.entropy_coding_mode_flag) {
+		c.mb_skip_run = -1;
+		parse_slice_data_cavlc(&c);
+		// FIXME detect and signal error
+	} else {
+		// cabac_alignment_one_bit gives a good probability to catch random errors.
+		if (cabac_start(&c)) {
+			ret = EBADMSG; // FIXME error_flag
+		} else {
+			cabac_init(&c);
+			c.mb_qp_delta_nz = 0;
+			parse_slice_data_cabac(&c);
+			// the possibility of cabac_zero_word implies we should not expect a start code yet
+			if (c.t._gb.msb_cache != 0 || (c.t._gb.lsb_cache & (c.t._gb.lsb_cache - 1))) {
+				ret = EBADMSG; // FIXME error_flag
 			}
 		}
-		if (c.t.free_cb)
-			c.t.free_cb(c.t.free_arg, (int)ret);
-		dec->busy_tasks &= ~(1 << task_id);
-		dec->task_dependencies[task_id] = 0;
-		dec->taskPics[task_id] = -1;
-		
-		// in single-thread mode update the buffer pointer and return
-		if (!c.n_threads) {
-			dec->_gb = c.t._gb;
-			return (void *)ret;
+	}
+	
+	if (c.recon_ops)
+		finish_recon(&c);
+	
+	// deblock the rest of mbs in this slice
+	if (c.t.next_deblock_addr >= 0) {
+		c.t.next_deblock_addr = max(c.t.next_deblock_addr, c.t.first_mb_in_slice);
+		deblock_until(&c, c.CurrMbAddr);
+	}
+	
+	// on error, recover mbs and signal them as erroneous (allows overwrite by redundant slices)
+	if (__builtin_expect(ret != 0, 0))
+		recover_slice(&c, currPic);
+	
+	// update dec->next_deblock_addr, considering it might have reached first_mb_in_slice since start
+	if (!c.t.deblock_separately && dec->next_deblock_addr[currPic] >= c.t.first_mb_in_slice &&
+	    !(c.t.disable_deblocking_filter_idc == 0 && c.t.next_deblock_addr < 0)) {
+		dec->next_deblock_addr[currPic] = c.CurrMbAddr;
+		pthread_cond_broadcast(&dec->task_progress);
+	}
+	
+	// deblock the rest of the frame if all mbs have been decoded correctly
+	int remaining_mbs = ret ?: __atomic_sub_fetch(&dec->remaining_mbs[currPic], c.CurrMbAddr - c.t.first_mb_in_slice, __ATOMIC_ACQ_REL);
+	if (remaining_mbs == 0 && !c.t.deblock_separately) {
+		c.t.next_deblock_addr = dec->next_deblock_addr[currPic];
+		deblock_until(&c, c.t.pic_width_in_mbs * c.t.pic_height_in_mbs);
+		if (dec->convert_flags & 1 << currPic)
+			convert_rows(dec, currPic, INT_MAX);
+		dec->next_deblock_addr[currPic] = INT_MAX; // signals the frame is complete
+	}
+	
+	// if multi-threaded, check if we are the last task to touch this frame and ensure it is complete
+	if (c.n_threads) {
+		pthread_mutex_lock(&dec->lock);
+		if (c.t.deblock_separately && (remaining_mbs == 0 || dec->next_decode_addr[currPic] >= (int)c.t.first_mb_in_slice)) {
+			dec->next_decode_addr[currPic] = remaining_mbs == 0 ? c.t.pic_width_in_mbs * c.t.pic_height_in_mbs :
+				max(dec->next_decode_addr[currPic], c.CurrMbAddr);
 		}
+		pthread_cond_signal(&dec->task_complete);
+		print_header(dec, "<h>Thread finished decoding frame %d at macroblock %d</h>\n", dec->FieldOrderCnt[0][currPic], c.t.first_mb_in_slice);
+		pthread_cond_broadcast(&dec->task_progress);
+		if (remaining_mbs == 0 && !c.t.deblock_separately)
+			output_frames(dec);
+	}
+	if (c.t.free_cb)
+		c.t.free_cb(c.t.free_arg, (int)ret);
+	dec->busy_tasks &= ~((uint64_t)1 << task_id);
+	dec->reference_tasks &= ~((uint64_t)1 << task_id);
+	dec->task_dependencies[task_id] = 0;
+	dec->taskPics[task_id] = -1;
+	if (c.n_threads) {
+		// the deblocking task of the frame may be released now that this slice is done
+		if (publish_ready_tasks(dec))
+			signal_ready_tasks(dec);
 	}
+	
+	
+	// in single-thread mode update the buffer pointer
+	if (!c.n_threads)
+		dec->_gb = c.t._gb;
+	return (int)ret;
+}
+
+
+
+/**
+ * This function is the entry point for each worker thread owned by a decoder,
+ * where it consumes tasks continuously until edge264_free sets exit_flag.
+ */
+void *ADD_VARIANT(worker_loop)(Edge264Decoder *dec) {
+	pthread_mutex_lock(&dec->lock);
+	while (!dec->exit_flag) {
+		if (dec->ready_tasks)
+			ADD_VARIANT(decode_task)(dec);
+		else
+			pthread_cond_wait(&dec->task_ready, &dec->lock);
+	}
+	pthread_mutex_unlock(&dec->lock);
 	return NULL;
 }
 
@@ -720,11 +1236,93 @@ static void parse_ref_pic_list_modification(Edge264Decoder *dec, Edge264Task *t)
 
 
 
+/**
+ * With huge pages, frame buffers are first requested as explicit 2MB pages,
+ * which may fail if none were reserved by the system, then as normal pages
+ * aligned on 2MB and advised for transparent huge pages (THP). The mode
+ * obtained for each buffer is counted in stats.
+ */
+static size_t huge_size(size_t size) {
+	return (size + HUGE_PAGE_SIZE - 1) & -HUGE_PAGE_SIZE;
+}
+
+static uint8_t *alloc_huge(Edge264Decoder *dec, int id) {
+	#if defined(MAP_HUGETLB)
+		void *p = mmap(NULL, huge_size(dec->frame_capacity), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED) {
+			dec->hugetlb_flags |= 1 << id;
+			dec->stats.frames_hugetlb++;
+			return p;
+		}
+	#endif
+	#if defined(MADV_HUGEPAGE)
+		void *q;
+		if (posix_memalign(&q, HUGE_PAGE_SIZE, huge_size(dec->frame_capacity)))
+			return NULL;
+		if (madvise(q, huge_size(dec->frame_capacity), MADV_HUGEPAGE) == 0)
+			dec->stats.frames_thp++;
+		return q;
+	#else
+		return malloc(dec->frame_capacity);
+	#endif
+}
+
 static int alloc_frame(Edge264Decoder *dec, int id) {
-	dec->frame_buffers[id] = malloc(dec->frame_size);
+	dec->frame_buffers[id] = dec->alloc_cb ? dec->alloc_cb(dec->alloc_arg, dec->frame_capacity) :
+		dec->huge_pages ? alloc_huge(dec, id) : malloc(dec->frame_capacity);
 	if (dec->frame_buffers[id] == NULL)
 		return ENOMEM;
-	Edge264Macroblock *m = (Edge264Macroblock *)(dec->frame_buffers[id] + dec->plane_size_Y + dec->plane_size_C);
+	
+	// with preallocation, fault all pages in now rather than while decoding
+	if (dec->prealloc_mode != EDGE264_PREALLOC_NONE) {
+		#ifndef _WIN32
+			if (dec->prealloc_mode == EDGE264_PREALLOC_LOCK && mlock(dec->frame_buffers[id], dec->frame_capacity) == 0)
+				dec->locked_flags |= 1 << id;
+		#endif
+		for (int32_t i = 0; i < dec->frame_capacity; i += 4096)
+			((volatile uint8_t *)dec->frame_buffers[id])[i] = 0;
+	}
+	return 0;
+}
+
+
+
+/**
+ * Macroblock arrays are allocated apart from frame buffers, and are needed
+ * only while a frame is decoded or used for reference (as mbCol). A frame
+ * starting without one takes it from a frame that is done with it, such that
+ * non-reference and output-only frames mostly hold samples, and arrays are
+ * allocated only up to the number of frames in use at once. Preallocation
+ * passes an empty idle mask to allocate a new array for each frame.
+ */
+static unsigned idle_mbs(Edge264Decoder *dec) {
+	unsigned used = dec->reference_flags | dec->pic_reference_flags | depended_frames(dec);
+	if (dec->currPic >= 0)
+		used |= 1 << dec->currPic;
+	if (dec->basePic >= 0)
+		used |= 1 << dec->basePic;
+	unsigned idle = 0;
+	for (int i = 0; i < 32; i++)
+		idle |= (dec->frame_mbs[i] != NULL && !(used & 1 << i) && !frame_tasks(dec, i)) << i;
+	return idle;
+}
+
+static int acquire_mbs(Edge264Decoder *dec, int id, unsigned idle) {
+	idle &= ~(1 << id);
+	if (idle) {
+		int i = __builtin_ctz(idle);
+		dec->frame_mbs[id] = dec->frame_mbs[i];
+		dec->frame_mbs[i] = NULL;
+	} else if (!(dec->frame_mbs[id] = malloc(dec->mbs_size))) {
+		return ENOMEM;
+	} else {
+		// neighbours A and B are read before checking their availability, so the first row needs a row of empty mbs above it
+		for (int i = 0; i <= dec->sps.pic_width_in_mbs; i++)
+			dec->frame_mbs[id][i] = unavail_mb;
+	}
+	
+	// reset recovery_bits to match the first flip of frame_flip_bits, and set the empty mbs at the edge
+	Edge264Macroblock *m = dec->frame_mbs[id] + dec->sps.pic_width_in_mbs + 1;
 	int mbs = (dec->sps.pic_width_in_mbs + 1) * dec->sps.pic_height_in_mbs - 1;
 	for (int i = 0; i < mbs; i += dec->sps.pic_width_in_mbs + 1) {
 		for (int j = i; j < i + dec->sps.pic_width_in_mbs; j++)
@@ -732,9 +1330,54 @@ static int alloc_frame(Edge264Decoder *dec, int id) {
 		if (i + dec->sps.pic_width_in_mbs < mbs)
 			m[i + dec->sps.pic_width_in_mbs] = unavail_mb;
 	}
+	dec->frame_flip_bits &= ~(1 << id);
 	return 0;
 }
 
+static void free_converted(Edge264Decoder *dec, int id) {
+	if (dec->alloc_cb == NULL) {
+		free(dec->converted_buffers[id]);
+	} else if (dec->dealloc_cb != NULL && dec->converted_buffers[id] != NULL) {
+		dec->dealloc_cb(dec->alloc_arg, dec->converted_buffers[id]);
+	}
+	dec->converted_buffers[id] = NULL;
+}
+
+/**
+ * Side buffers depend on the frame format, thus are released along with
+ * frame buffers, or alone when frame buffers are reused for a new format.
+ */
+static void free_side_buffers(Edge264Decoder *dec, int id) {
+	free(dec->frame_mbs[id]);
+	dec->frame_mbs[id] = NULL;
+	free(dec->mb_infos[id]);
+	dec->mb_infos[id] = NULL;
+	free(dec->mb_maps[id]);
+	dec->mb_maps[id] = NULL;
+	free(dec->scaled_buffers[id]);
+	dec->scaled_buffers[id] = NULL;
+	free_converted(dec, id);
+}
+
+static void free_frame(Edge264Decoder *dec, int id) {
+	#ifndef _WIN32
+		if (dec->locked_flags & 1 << id)
+			munlock(dec->frame_buffers[id], dec->frame_capacity);
+		if (dec->hugetlb_flags & 1 << id)
+			munmap(dec->frame_buffers[id], huge_size(dec->frame_capacity));
+	#endif
+	if (dec->hugetlb_flags & 1 << id) {
+		dec->hugetlb_flags &= ~(1 << id);
+	} else if (dec->alloc_cb == NULL) {
+		free(dec->frame_buffers[id]);
+	} else if (dec->dealloc_cb != NULL) {
+		dec->dealloc_cb(dec->alloc_arg, dec->frame_buffers[id]);
+	}
+	dec->locked_flags &= ~(1 << id);
+	dec->frame_buffers[id] = NULL;
+	free_side_buffers(dec, id);
+}
+
 
 
 /**
@@ -768,7 +1411,7 @@ static void initialize_task(Edge264Decoder *dec, Edge264Task *t)
 {
 	// set task pointer to current pointer and current pointer to next start code
 	t->_gb = dec->_gb;
-	if (dec->n_threads) {
+	if (dec->n_threads && !dec->nal_end_known) {
 		t->_gb.end = edge264_find_start_code(dec->_gb.CPB - 2, dec->_gb.end); // works if CPB already crossed end
 		dec->_gb.CPB = t->_gb.end + 2;
 	}
@@ -777,24 +1420,33 @@ static void initialize_task(Edge264Decoder *dec, Edge264Task *t)
 	t->ChromaArrayType = dec->sps.ChromaArrayType;
 	t->direct_8x8_inference_flag = dec->sps.direct_8x8_inference_flag;
 	t->frame_flip_bit = dec->frame_flip_bits >> dec->currPic & 1;
+	t->max_ref_rows = dec->sps.max_ref_rows;
 	t->pic_width_in_mbs = dec->sps.pic_width_in_mbs;
 	t->pic_height_in_mbs = dec->sps.pic_height_in_mbs;
 	t->stride[0] = dec->out.stride_Y;
 	t->stride[1] = t->stride[2] = dec->out.stride_C;
 	t->plane_size_Y = dec->plane_size_Y;
 	t->plane_size_C = dec->plane_size_C;
-	t->next_deblock_idc = (dec->next_deblock_addr[dec->currPic] == t->first_mb_in_slice &&
-		dec->nal_ref_idc) ? dec->currPic : -1;
-	t->next_deblock_addr = (dec->next_deblock_addr[dec->currPic] == t->first_mb_in_slice ||
-		t->disable_deblocking_filter_idc == 2) ? t->first_mb_in_slice : INT_MIN;
+	t->deblock_separately = dec->n_threads > 1; // otherwise no other thread would deblock in parallel
+	t->parse_only = dec->parse_only_flags >> dec->currPic & 1;
+	t->luma_only = dec->plane_size_C == 0;
+	t->mb_info = (dec->mb_info_flags & 1 << dec->currPic) ? dec->mb_infos[dec->currPic] : NULL;
+	t->mb_maps = (dec->mb_maps_flags & 1 << dec->currPic) ? dec->mb_maps[dec->currPic] : NULL;
+	t->next_deblock_idc = ((dec->next_deblock_addr[dec->currPic] == t->first_mb_in_slice &&
+		dec->nal_ref_idc) || t->deblock_separately) ? dec->currPic : -1;
+	t->next_deblock_addr = (!t->deblock_separately && (dec->next_deblock_addr[dec->currPic] == t->first_mb_in_slice ||
+		t->disable_deblocking_filter_idc == 2)) ? t->first_mb_in_slice : INT_MIN;
 	t->long_term_flags = dec->long_term_flags;
 	t->samples_base = dec->frame_buffers[dec->currPic];
+	t->mbs_base = t->mbs_col = dec->frame_mbs[dec->currPic] + dec->sps.pic_width_in_mbs + 1;
 	t->samples_clip_v[0] = set16((1 << dec->sps.BitDepth_Y) - 1);
 	t->samples_clip_v[1] = t->samples_clip_v[2] = set16((1 << dec->sps.BitDepth_C) - 1);
 	
 	// P/B slices
 	if (t->slice_type < 2) {
 		memcpy(t->frame_buffers, dec->frame_buffers, sizeof(t->frame_buffers));
+		if (t->slice_type == 1 && t->RefPicList[1][0] >= 0)
+			t->mbs_col = dec->frame_mbs[t->RefPicList[1][0]] + dec->sps.pic_width_in_mbs + 1;
 		if (t->slice_type == 1 && (t->pps.weighted_bipred_idc == 2 || !t->direct_spatial_mv_pred_flag)) {
 			i32x4 poc = set32(min(dec->TopFieldOrderCnt, dec->BottomFieldOrderCnt));
 			t->diff_poc_v[0] = packs32(poc - min32(dec->FieldOrderCnt_v[0][0], dec->FieldOrderCnt_v[1][0]),
@@ -811,6 +1463,34 @@ static void initialize_task(Edge264Decoder *dec, Edge264Task *t)
 
 
 
+/**
+ * Called on the first slice of each picture when a frame period is set, to
+ * compare the current time with the time this picture was expected at. Being
+ * late by more than a period raises the level of degradation by one step
+ * (bypass deblocking of non-ref pictures, then drop non-ref pictures, then
+ * drop non-IDR pictures), while being on time lowers it by one step. Pictures
+ * ahead of time do not accumulate credit for later ones. Lowering the level
+ * does not resume decoding after a dropped reference picture, which waits for
+ * the next IDR picture (with refs_dropped).
+ */
+static void update_deadline_level(Edge264Decoder *dec) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	int64_t now = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	if (dec->deadline_next == 0)
+		dec->deadline_next = now;
+	int64_t lag = now - dec->deadline_next;
+	if (lag > dec->deadline_period && dec->deadline_level < 3) {
+		dec->deadline_level++;
+	} else if (lag <= 0 && dec->deadline_level > 0) {
+		dec->deadline_level--;
+	}
+	dec->deadline_next = (lag < 0 ? now : dec->deadline_next) + dec->deadline_period;
+	print_header(dec, "<k>Deadline lag/level</k><v>%lldus/%d</v>\n", (long long)(lag / 1000), dec->deadline_level);
+}
+
+
+
 /**
  * This function matches slice_header() in 7.3.3, which it parses while updating
  * the DPB and initialising slice data for further decoding.
@@ -823,13 +1503,14 @@ int ADD_VARIANT(parse_slice_layer_without_partitioning)(Edge264Decoder *dec, int
 	#endif
 	
 	// reserving a slot without locking is fine since workers can only unset busy_tasks
-	unsigned avail_tasks;
-	while (!(avail_tasks = 0xffff & ~dec->busy_tasks)) {
+	// (with separate deblocking, a second slot is kept for the deblocking task of a new frame)
+	uint64_t avail_tasks;
+	while (!(avail_tasks = ~dec->busy_tasks) || (dec->n_threads > 1 && !(avail_tasks & (avail_tasks - 1)))) {
 		if (non_blocking)
 			return EWOULDBLOCK;
 		pthread_cond_wait(&dec->task_complete, &dec->lock);
 	}
-	Edge264Task *t = dec->tasks + __builtin_ctz(avail_tasks);
+	Edge264Task *t = dec->tasks + ctz64(avail_tasks);
 	t->free_cb = free_cb;
 	t->free_arg = free_arg;
 	
@@ -920,7 +1601,8 @@ int ADD_VARIANT(parse_slice_layer_without_partitioning)(Edge264Decoder *dec, int
 					dec->sps.PicOrderCntDeltas[FrameNum % dec->sps.num_ref_frames_in_pic_order_cnt_cycle];
 			}
 			dec->FieldOrderCnt[0][i] = dec->FieldOrderCnt[1][i] = PicOrderCnt;
-			if (dec->frame_buffers[i] == NULL && alloc_frame(dec, i))
+			if ((dec->frame_buffers[i] == NULL && alloc_frame(dec, i)) ||
+			    (dec->frame_mbs[i] == NULL && acquire_mbs(dec, i, idle_mbs(dec))))
 				return ENOMEM;
 		}
 		dec->prevRefFrameNum[non_base_view] = dec->FrameNum - 1;
@@ -992,6 +1674,31 @@ int ADD_VARIANT(parse_slice_layer_without_partitioning)(Edge264Decoder *dec, int
 	// find and possibly allocate a DPB slot for the upcoming frame
 	if (dec->currPic >= 0 && non_base_view != (dec->currPic & dec->sps.mvc))
 		finish_frame(dec, 1);
+	
+	// drop the entire picture if its first slice does not match the skip mode
+	if (dec->currPic < 0 && dec->deadline_period > 0 && t->first_mb_in_slice == 0)
+		update_deadline_level(dec);
+	static const int8_t deadline_skip_modes[4] = {EDGE264_SKIP_NONE, EDGE264_SKIP_NONE, EDGE264_SKIP_NON_REF, EDGE264_SKIP_NON_IDR};
+	int skip_mode = max(dec->skip_mode, deadline_skip_modes[dec->deadline_level]);
+	if (dec->IdrPicFlag)
+		dec->refs_dropped = 0;
+	if (dec->currPic < 0 && (skip_mode != EDGE264_SKIP_NONE || dec->refs_dropped) && (t->first_mb_in_slice > 0 ||
+	    dec->refs_dropped || (skip_mode == EDGE264_SKIP_NON_REF && dec->nal_ref_idc == 0) ||
+	    (skip_mode == EDGE264_SKIP_NON_INTRA && t->slice_type != 2) ||
+	    (skip_mode == EDGE264_SKIP_NON_IDR && !dec->IdrPicFlag))) {
+		// keep POC derivation going, and release frames like a decoded non-ref picture would
+		if (dec->nal_ref_idc)
+			dec->prevPicOrderCnt = dec->TopFieldOrderCnt;
+		else
+			dec->dispPicOrderCnt = max(dec->dispPicOrderCnt, dec->TopFieldOrderCnt);
+		dec->stats.slices_skipped++;
+		dec->pictures_dropped += t->first_mb_in_slice == 0;
+		dec->refs_dropped |= dec->nal_ref_idc != 0; // later pictures may reference it, so resume only at an IDR
+		print_header(dec, "<k>Skipped by skip mode</k><v>%d</v>\n", skip_mode);
+		if (free_cb)
+			free_cb(free_arg, 0);
+		return 0;
+	}
 	int is_first_slice = 0;
 	if (dec->currPic < 0) {
 		// get a mask of free slots or find the next to be released by get_frame
@@ -1016,16 +1723,52 @@ int ADD_VARIANT(parse_slice_layer_without_partitioning)(Edge264Decoder *dec, int
 		if (ready & (dec->output_flags | dec->borrow_flags))
 			return ENOBUFS;
 		dec->currPic = __builtin_ctz(ready);
-		if (dec->frame_buffers[dec->currPic] == NULL && alloc_frame(dec, dec->currPic))
+		if ((dec->frame_buffers[dec->currPic] == NULL && alloc_frame(dec, dec->currPic)) ||
+		    (dec->frame_mbs[dec->currPic] == NULL && acquire_mbs(dec, dec->currPic, idle_mbs(dec))))
 			return ENOMEM;
 		dec->frame_flip_bits ^= 1 << dec->currPic;
 		dec->remaining_mbs[dec->currPic] = dec->sps.pic_width_in_mbs * dec->sps.pic_height_in_mbs;
 		dec->next_deblock_addr[dec->currPic] = 0;
+		dec->next_decode_addr[dec->currPic] = 0;
 		dec->FrameNums[dec->currPic] = dec->FrameNum;
 		dec->FieldOrderCnt[0][dec->currPic] = dec->TopFieldOrderCnt;
 		dec->FieldOrderCnt[1][dec->currPic] = dec->BottomFieldOrderCnt;
+		unsigned bit = 1 << dec->currPic;
+		dec->mb_info_flags = (dec->mb_info_flags & ~bit) | (dec->mb_info_mode != EDGE264_MB_INFO_NONE ? bit : 0);
+		dec->parse_only_flags = (dec->parse_only_flags & ~bit) | (dec->mb_info_mode == EDGE264_MB_INFO_ONLY ? bit : 0);
+		if ((dec->mb_info_flags & bit) && dec->mb_infos[dec->currPic] == NULL &&
+		    !(dec->mb_infos[dec->currPic] = malloc(dec->sps.pic_width_in_mbs * dec->sps.pic_height_in_mbs * sizeof(Edge264MbInfo))))
+			return ENOMEM;
+		dec->mb_maps_flags = (dec->mb_maps_flags & ~bit) | (dec->mb_maps_enabled ? bit : 0);
+		if ((dec->mb_maps_flags & bit) && dec->mb_maps[dec->currPic] == NULL &&
+		    !(dec->mb_maps[dec->currPic] = malloc(dec->sps.pic_width_in_mbs * dec->sps.pic_height_in_mbs * 4)))
+			return ENOMEM;
+		int shift = (dec->parse_only_flags & bit) ? 0 : dec->scale_shift;
+		if (shift != dec->frame_scale_shifts[dec->currPic]) {
+			free(dec->scaled_buffers[dec->currPic]);
+			dec->scaled_buffers[dec->currPic] = NULL;
+		}
+		dec->frame_scale_shifts[dec->currPic] = shift;
+		if (shift > 0 && dec->scaled_buffers[dec->currPic] == NULL &&
+		    !(dec->scaled_buffers[dec->currPic] = malloc(scaled_size(dec, shift))))
+			return ENOMEM;
+		int format = (dec->parse_only_flags & bit) ? EDGE264_FORMAT_I420 : dec->output_format;
+		if (format != dec->frame_output_formats[dec->currPic])
+			free_converted(dec, dec->currPic);
+		dec->frame_output_formats[dec->currPic] = format;
+		if (format != EDGE264_FORMAT_I420 && dec->converted_buffers[dec->currPic] == NULL &&
+		    !(dec->converted_buffers[dec->currPic] = dec->alloc_cb ? dec->alloc_cb(dec->alloc_arg, converted_size(dec, format)) : malloc(converted_size(dec, format))))
+			return ENOMEM;
+		dec->convert_flags = (dec->convert_flags & ~bit) | (shift > 0 || format != EDGE264_FORMAT_I420 ? bit : 0);
+		dec->converted_rows[dec->currPic] = 0;
+		dec->frame_deadline_levels[dec->currPic] = dec->deadline_level;
+		dec->frame_pictures_dropped[dec->currPic] = min(dec->pictures_dropped, UINT16_MAX);
+		dec->pictures_dropped = 0;
+		dec->frame_ref_flags &= ~bit;
 		is_first_slice = 1;
 	}
+	if (dec->nal_ref_idc)
+		dec->frame_ref_flags |= 1 << dec->currPic;
 	
 	// The first test could be optimised into a fast bit test, but would be less readable :)
 	t->RefPicList_v[0] = t->RefPicList_v[1] = t->RefPicList_v[2] = t->RefPicList_v[3] =
@@ -1087,10 +1830,18 @@ int ADD_VARIANT(parse_slice_layer_without_partitioning)(Edge264Decoder *dec, int
 		print_header(dec, "<k>disable_deblocking_filter_idc (inferred)</k><v>0 (enabled)</v>\n"
 			"<k>FilterOffsets (inferred)</k><v>0, 0</v>\n");
 	}
+	int deblock_mode = max(dec->deblock_mode, dec->deadline_level > 0 ? EDGE264_DEBLOCK_REF : EDGE264_DEBLOCK_ALL);
+	if (deblock_mode == EDGE264_DEBLOCK_NONE || (deblock_mode == EDGE264_DEBLOCK_REF && dec->nal_ref_idc == 0) ||
+	    (dec->parse_only_flags & 1 << dec->currPic)) {
+		t->disable_deblocking_filter_idc = 1; // mbs then get no filter_edges, while frame progress is signaled as usual
+		print_header(dec, "<k>disable_deblocking_filter_idc (forced)</k><v>1 (disabled)</v>\n");
+	}
 	
 	// update output flags now that we know if mmco5 happened
 	unsigned to_output = 1 << dec->currPic;
 	if (is_first_slice) {
+		dec->poc_epoch += dec->IdrPicFlag && dec->basePic < 0; // a non-base view shares the epoch of its base view
+		dec->FrameEpochs[dec->currPic] = dec->poc_epoch;
 		if (!dec->sps.mvc || (to_output |= 1 << dec->basePic, dec->basePic >= 0)) {
 			if (dec->IdrPicFlag) {
 				dec->dispPicOrderCnt = -(1 << 25);
@@ -1120,14 +1871,28 @@ int ADD_VARIANT(parse_slice_layer_without_partitioning)(Edge264Decoder *dec, int
 	// prepare the task and signal it
 	initialize_task(dec, t);
 	int task_id = t - dec->tasks;
-	dec->busy_tasks |= 1 << task_id;
-	dec->pending_tasks |= 1 << task_id;
+	dec->busy_tasks |= (uint64_t)1 << task_id;
+	dec->pending_tasks |= (uint64_t)1 << task_id;
+	dec->reference_tasks |= (uint64_t)(dec->nal_ref_idc != 0) << task_id;
 	dec->task_dependencies[task_id] = refs_to_mask(t);
-	dec->ready_tasks |= ((dec->task_dependencies[task_id] & ~ready_frames(dec)) == 0) << task_id;
 	dec->taskPics[task_id] = dec->currPic;
+	
+	// a deblocking task follows all slices of the frame, and is added again if it was released before a late slice
+	if (t->deblock_separately && dec->next_deblock_addr[dec->currPic] != INT_MAX &&
+	    !(frame_tasks(dec, dec->currPic) & dec->deblock_tasks)) {
+		int deblock_id = ctz64(~dec->busy_tasks);
+		dec->tasks[deblock_id] = *t;
+		dec->tasks[deblock_id].free_cb = NULL;
+		dec->busy_tasks |= (uint64_t)1 << deblock_id;
+		dec->pending_tasks |= (uint64_t)1 << deblock_id;
+		dec->deblock_tasks |= (uint64_t)1 << deblock_id;
+		dec->task_dependencies[deblock_id] = 0;
+		dec->taskPics[deblock_id] = dec->currPic;
+	}
+	publish_ready_tasks(dec);
 	if (!dec->n_threads)
-		return (intptr_t)ADD_VARIANT(worker_loop)(dec);
-	pthread_cond_signal(&dec->task_ready);
+		return ADD_VARIANT(decode_task)(dec);
+	signal_ready_tasks(dec);
 	return 0;
 }
 
@@ -1161,6 +1926,100 @@ int ADD_VARIANT(parse_nal_unit_header_extension)(Edge264Decoder *dec, int non_bl
 
 
 
+/**
+ * Probing parses the start of slice headers up to POC, with the same
+ * derivations as parse_slice_layer_without_partitioning but on a separate
+ * state, and without reserving tasks or DPB slots. A new picture is detected
+ * with first_mb_in_slice == 0, at which point the previous one is committed as
+ * reference for POC decoding. Memory management operations are not parsed,
+ * so POCs following a mmco5 are not reset.
+ */
+int ADD_VARIANT(probe_slice_header)(Edge264Decoder *dec, Edge264NalInfo *info)
+{
+	refill(&dec->_gb, 0);
+	int non_base_view = 0;
+	int IdrPicFlag = dec->nal_unit_type == 5;
+	if (dec->nal_unit_type == 20) {
+		unsigned u = get_uv(&dec->_gb, 24);
+		if (u & 1 << 23)
+			return ENOTSUP;
+		IdrPicFlag = u >> 22 & 1 ^ 1;
+		non_base_view = 1;
+	}
+	info->IdrPicFlag = IdrPicFlag;
+	info->non_base_view = non_base_view;
+	info->first_mb_in_slice = get_ue32(&dec->_gb, 139263);
+	int slice_type = get_ue16(&dec->_gb, 9);
+	info->slice_type = (slice_type < 5) ? slice_type : slice_type - 5;
+	int pic_parameter_set_id = get_ue16(&dec->_gb, 255);
+	info->pic_parameter_set_id = pic_parameter_set_id;
+	if (info->slice_type > 2 || pic_parameter_set_id >= 4)
+		return ENOTSUP;
+	const Edge264PicParameterSet *pps = &dec->PPS[pic_parameter_set_id];
+	if (pps->num_ref_idx_active[0] == 0)
+		return EBADMSG;
+	
+	// commit the previous picture when a new one starts
+	if (info->first_mb_in_slice == 0 && !non_base_view) {
+		if (dec->probe_ref)
+			dec->probe_prevPicOrderCnt = dec->probe_PicOrderCnt;
+		dec->probe_ref = dec->nal_ref_idc != 0;
+		info->new_picture = 1;
+	}
+	
+	// parse frame_num
+	int frame_num = get_uv(&dec->_gb, dec->sps.log2_max_frame_num);
+	int FrameNumMask = (1 << dec->sps.log2_max_frame_num) - 1;
+	int prevRefFrameNum = IdrPicFlag ? 0 : dec->probe_prevRefFrameNum[non_base_view];
+	int FrameNum = prevRefFrameNum + ((frame_num - prevRefFrameNum) & FrameNumMask);
+	if (dec->nal_ref_idc)
+		dec->probe_prevRefFrameNum[non_base_view] = FrameNum;
+	info->frame_num = frame_num;
+	info->FrameNum = FrameNum;
+	if (!dec->sps.frame_mbs_only_flag && get_u1(&dec->_gb))
+		return ENOTSUP; // field_pic_flag
+	if (IdrPicFlag)
+		get_ue32(&dec->_gb, 65535);
+	
+	// Compute Top/BottomFieldOrderCnt (8.2.1).
+	int TopFieldOrderCnt, BottomFieldOrderCnt;
+	if (dec->sps.pic_order_cnt_type == 0) {
+		int pic_order_cnt_lsb = get_uv(&dec->_gb, dec->sps.log2_max_pic_order_cnt_lsb);
+		int shift = WORD_BIT - dec->sps.log2_max_pic_order_cnt_lsb;
+		int prevPicOrderCnt = IdrPicFlag ? 0 : dec->probe_prevPicOrderCnt;
+		TopFieldOrderCnt = prevPicOrderCnt + ((pic_order_cnt_lsb - prevPicOrderCnt) << shift >> shift);
+		int delta_pic_order_cnt_bottom = 0;
+		if (pps->bottom_field_pic_order_in_frame_present_flag)
+			delta_pic_order_cnt_bottom = get_se32(&dec->_gb, (-1u << 31) + 1, (1u << 31) - 1);
+		BottomFieldOrderCnt = TopFieldOrderCnt + delta_pic_order_cnt_bottom;
+	} else if (dec->sps.pic_order_cnt_type == 1) {
+		unsigned absFrameNum = FrameNum + (dec->nal_ref_idc != 0) - 1;
+		TopFieldOrderCnt = (dec->nal_ref_idc) ? 0 : dec->sps.offset_for_non_ref_pic;
+		if (dec->sps.num_ref_frames_in_pic_order_cnt_cycle > 0) {
+			TopFieldOrderCnt += (absFrameNum / dec->sps.num_ref_frames_in_pic_order_cnt_cycle) *
+				dec->sps.PicOrderCntDeltas[dec->sps.num_ref_frames_in_pic_order_cnt_cycle] +
+				dec->sps.PicOrderCntDeltas[absFrameNum % dec->sps.num_ref_frames_in_pic_order_cnt_cycle];
+		}
+		int delta_pic_order_cnt0 = 0, delta_pic_order_cnt1 = 0;
+		if (!dec->sps.delta_pic_order_always_zero_flag) {
+			delta_pic_order_cnt0 = get_se32(&dec->_gb, (-1u << 31) + 1, (1u << 31) - 1);
+			if (pps->bottom_field_pic_order_in_frame_present_flag)
+				delta_pic_order_cnt1 = get_se32(&dec->_gb, (-1u << 31) + 1, (1u << 31) - 1);
+		}
+		TopFieldOrderCnt += delta_pic_order_cnt0;
+		BottomFieldOrderCnt = TopFieldOrderCnt + delta_pic_order_cnt1;
+	} else {
+		TopFieldOrderCnt = BottomFieldOrderCnt = FrameNum * 2 + (dec->nal_ref_idc != 0) - 1;
+	}
+	if (!non_base_view)
+		dec->probe_PicOrderCnt = TopFieldOrderCnt;
+	info->TopFieldOrderCnt = TopFieldOrderCnt;
+	info->BottomFieldOrderCnt = BottomFieldOrderCnt;
+	return 0;
+}
+
+
+
 /**
  * Parses the scaling lists into w4x4 and w8x8 (7.3.2.1 and Table 7-2).
  *
@@ -1428,7 +2287,8 @@ static void parse_hrd_parameters(Edge264Decoder *dec) {
 
 /**
  * To avoid cluttering the memory layout with unused data, VUI parameters are
- * mostly ignored until explicitly asked in the future.
+ * mostly ignored until explicitly asked in the future. Only the color format
+ * is kept for conversions to RGB.
  */
 static void parse_vui_parameters(Edge264Decoder *dec, Edge264SeqParameterSet *sps)
 {
@@ -1505,16 +2365,16 @@ static void parse_vui_parameters(Edge264Decoder *dec, Edge264SeqParameterSet *sp
 	}
 	if (get_u1(&dec->_gb)) {
 		int video_format = get_uv(&dec->_gb, 3);
-		int video_full_range_flag = get_u1(&dec->_gb);
+		sps->video_full_range_flag = get_u1(&dec->_gb);
 		print_header(dec, "<k>video_format</k><v>%u (%s)</v>\n"
 			"<k>video_full_range_flag</k><v>%x</v>\n",
 			video_format, video_format_names[video_format],
-			video_full_range_flag);
+			sps->video_full_range_flag);
 		if (get_u1(&dec->_gb)) {
 			unsigned desc = get_uv(&dec->_gb, 24);
 			int colour_primaries = desc >> 16;
 			int transfer_characteristics = (desc >> 8) & 0xff;
-			int matrix_coefficients = desc & 0xff;
+			int matrix_coefficients = sps->matrix_coefficients = desc & 0xff;
 			print_header(dec, "<k>colour_primaries</k><v>%u (%s)</v>\n"
 				"<k>transfer_characteristics</k><v>%u (%s)</v>\n"
 				"<k>matrix_coefficients</k><v>%u (%s)</v>\n",
@@ -1718,6 +2578,7 @@ int ADD_VARIANT(parse_seq_parameter_set)(Edge264Decoder *dec, int non_blocking,
 		.log2_max_pic_order_cnt_lsb = 16,
 		.mb_adaptive_frame_field_flag = 0,
 		.mvc = 0,
+		.matrix_coefficients = 2,
 		.PicOrderCntDeltas[0] = 0,
 		.weightScale4x4_v = {[0 ... 5] = {16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16}},
 		.weightScale8x8_v = {[0 ... 23] = {16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16}},
@@ -1826,6 +2687,8 @@ int ADD_VARIANT(parse_seq_parameter_set)(Edge264Decoder *dec, int non_blocking,
 		profile_idc == 100 || profile_idc == 110 || profile_idc == 122 ||
 		profile_idc == 244) && (constraint_set_flags & 1 << 4)) ? 0 : MaxDpbFrames;
 	sps.num_frame_buffers = max(sps.max_num_reorder_frames, sps.max_num_ref_frames) + 1;
+	int MaxVmvR = level_idc <= 10 ? 64 : level_idc <= 20 ? 128 : level_idc <= 30 ? 256 : 512;
+	sps.max_ref_rows = sps.frame_mbs_only_flag ? (MaxVmvR + 18) >> 4 : -1; // 15 rows below mb and 3 for 6-tap filter
 	sps.mb_adaptive_frame_field_flag = 0;
 	if (sps.frame_mbs_only_flag == 0)
 		sps.mb_adaptive_frame_field_flag = get_u1(&dec->_gb);
@@ -1890,10 +2753,20 @@ int ADD_VARIANT(parse_seq_parameter_set)(Edge264Decoder *dec, int non_blocking,
 		sps.qpprime_y_zero_transform_bypass_flag || !sps.frame_mbs_only_flag)
 		return ENOTSUP;
 	
+	// probing contexts keep only the SPS and its cropped dimensions
+	if (dec->probe_only) {
+		dec->sps = sps;
+		dec->out.width_Y = (sps.pic_width_in_mbs << 4) - sps.frame_crop_offsets[3] - sps.frame_crop_offsets[1];
+		dec->out.height_Y = (sps.pic_height_in_mbs << 4) - sps.frame_crop_offsets[0] - sps.frame_crop_offsets[2];
+		dec->out.width_mbs = sps.pic_width_in_mbs;
+		dec->out.height_mbs = sps.pic_height_in_mbs;
+		return 0;
+	}
+	
 	// apply the changes on the dependent variables if the frame format changed
 	int64_t offsets;
 	memcpy(&offsets, dec->out.frame_crop_offsets, 8);
-	if (sps.DPB_format != dec->DPB_format || sps.frame_crop_offsets_l != offsets) {
+	if (sps.DPB_format != dec->DPB_format || sps.frame_crop_offsets_l != offsets || dec->luma_only != dec->format_luma_only) {
 		if (dec->output_flags | dec->borrow_flags) {
 			for (unsigned o = dec->output_flags; o; o &= o - 1)
 				dec->dispPicOrderCnt = max(dec->dispPicOrderCnt, dec->FieldOrderCnt[0][__builtin_ctz(o)]);
@@ -1901,7 +2774,13 @@ int ADD_VARIANT(parse_seq_parameter_set)(Edge264Decoder *dec, int non_blocking,
 				pthread_cond_wait(&dec->task_complete, &dec->lock);
 			return dec->busy_tasks ? EWOULDBLOCK : ENOBUFS;
 		}
+		free(dec->mbp_rings);
+		if (!(dec->mbp_rings = malloc((sps.pic_width_in_mbs + 3) * 2 * MAX_TASKS * sizeof(Edge264MbParse))))
+			return ENOMEM;
+		dec->currPic = dec->basePic = -1;
+		dec->reference_flags = dec->long_term_flags = dec->frame_flip_bits = 0;
 		dec->DPB_format = sps.DPB_format;
+		dec->format_luma_only = dec->luma_only;
 		memcpy(dec->out.frame_crop_offsets, &sps.frame_crop_offsets_l, 8);
 		int width = sps.pic_width_in_mbs << 4;
 		int height = sps.pic_height_in_mbs << 4;
@@ -1909,9 +2788,12 @@ int ADD_VARIANT(parse_seq_parameter_set)(Edge264Decoder *dec, int non_blocking,
 		dec->out.width_Y = width - dec->out.frame_crop_offsets[3] - dec->out.frame_crop_offsets[1];
 		dec->out.height_Y = height - dec->out.frame_crop_offsets[0] - dec->out.frame_crop_offsets[2];
 		dec->out.stride_Y = width << dec->out.pixel_depth_Y;
+		dec->out.width_mbs = sps.pic_width_in_mbs;
+		dec->out.height_mbs = sps.pic_height_in_mbs;
 		if (!(dec->out.stride_Y & 2047)) // add an offset to stride if it is a multiple of 2048
 			dec->out.stride_Y += 16 << dec->out.pixel_depth_Y;
 		dec->plane_size_Y = dec->out.stride_Y * height;
+		dec->plane_size_C = 0;
 		if (sps.chroma_format_idc > 0) {
 			dec->out.pixel_depth_C = sps.BitDepth_C > 8;
 			dec->out.width_C = sps.chroma_format_idc == 3 ? dec->out.width_Y : dec->out.width_Y >> 1;
@@ -1919,20 +2801,38 @@ int ADD_VARIANT(parse_seq_parameter_set)(Edge264Decoder *dec, int non_blocking,
 			if (!(dec->out.stride_C & 4095)) // add an offset to stride if it is a multiple of 4096
 				dec->out.stride_C += (sps.chroma_format_idc == 3 ? 16 : 8) << dec->out.pixel_depth_C;
 			dec->out.height_C = sps.chroma_format_idc == 1 ? dec->out.height_Y >> 1 : dec->out.height_Y;
-			dec->plane_size_C = (sps.chroma_format_idc == 1 ? height >> 1 : height) * dec->out.stride_C;
+			if (!dec->luma_only)
+				dec->plane_size_C = (sps.chroma_format_idc == 1 ? height >> 1 : height) * dec->out.stride_C;
 		}
-		int mbs = (sps.pic_width_in_mbs + 1) * sps.pic_height_in_mbs - 1;
-		dec->frame_size = dec->plane_size_Y + dec->plane_size_C + mbs * sizeof(Edge264Macroblock);
-		dec->currPic = dec->basePic = -1;
-		dec->reference_flags = dec->long_term_flags = dec->frame_flip_bits = 0;
+		int mbs = (sps.pic_width_in_mbs + 1) * (sps.pic_height_in_mbs + 1) - 1; // with a row of empty mbs above the frame
+		int tail = (dec->plane_size_C ? dec->out.stride_C : 0) + 64; // inter prediction may read a row and a vector past the planes
+		dec->frame_size = dec->plane_size_Y + dec->plane_size_C + tail;
+		dec->mbs_size = mbs * sizeof(Edge264Macroblock);
+		
+		// keep frame buffers if they can hold the new format, otherwise release them all
 		for (int i = 0; i < 32; i++) {
-			if (dec->frame_buffers[i] != NULL) {
-				free(dec->frame_buffers[i]);
-				dec->frame_buffers[i] = NULL;
+			if (dec->frame_buffers[i] == NULL)
+				continue;
+			if (dec->frame_size > dec->frame_capacity) {
+				free_frame(dec, i);
+			} else {
+				free_side_buffers(dec, i);
 			}
 		}
+		dec->frame_capacity = max(dec->frame_capacity, dec->frame_size);
 	}
 	dec->sps = sps;
+	dec->out.video_full_range_flag = sps.video_full_range_flag;
+	dec->out.matrix_coefficients = sps.matrix_coefficients;
+	
+	// allocate all frames needed by the new SPS ahead of decoding
+	if (dec->prealloc_mode != EDGE264_PREALLOC_NONE) {
+		for (int i = 0; i < sps.num_frame_buffers; i++) {
+			if ((dec->frame_buffers[i] == NULL && alloc_frame(dec, i)) ||
+			    (i <= sps.max_num_ref_frames && dec->frame_mbs[i] == NULL && acquire_mbs(dec, i, 0)))
+				return ENOMEM;
+		}
+	}
 	return 0;
 }
 
@@ -1030,6 +1030,14 @@ static void noinline decode_inter(Edge264Context *ctx, int i, int w, int h) {
 	static int8_t shift_Y_8bit[46] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15};
 	static int8_t shift_C_8bit[22] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 2, 3, 4, 5, 6, 7, 7, 7, 7, 7, 7, 7, 7};
 	
+	// in pipelined slices, all parameters are read back from mb by another thread
+	if (ctx->t.parse_only)
+		return;
+	if (ctx->recon_ops) {
+		record_op(ctx, OP_INTER, w, i, NULL)->qP = h;
+		return;
+	}
+	
 	// load motion vector and reference picture
 	int x = mb->mvs[i * 2];
 	int y = mb->mvs[i * 2 + 1];
@@ -1128,30 +1136,34 @@ static void noinline decode_inter(Edge264Context *ctx, int i, int w, int h) {
 		sstride_Y = 32;
 		
 		// chroma may read (and ignore) 1 bottom row and 1 right col out of bounds
-		int width_C = width_Y >> 1;
-		i8x16 shuf = load64(shift_C_8bit + 7 + clip3(-7, 0, xInt_C) + clip3(0, 7, xInt_C + 8 - width_C));
-		src0 = ref + clip3(0, width_C - 8, xInt_C);
-		src1 = ref + clip3(0, width_C - 1, xInt_C + 8);
-		for (int j = 0; j <= h >> 1; j++, yInt_C++) {
-			int cb = ctx->t.plane_size_Y + clip3(0, ctx->t.plane_size_C - sstride_C * 2, yInt_C * sstride_C * 2);
-			int cr = sstride_C + cb;
-			// reads are split in 2 to support 8px-wide frames
-			ctx->edge_buf_l[j * 4 + 84] = ((i64x2)shuffle(load64(src0 + cb), shuf))[0];
-			ctx->edge_buf[j * 32 + 680] = *(src1 + cb);
-			ctx->edge_buf_l[j * 4 + 86] = ((i64x2)shuffle(load64(src0 + cr), shuf))[0];
-			ctx->edge_buf[j * 32 + 696] = *(src1 + cr);
+		if (!ctx->t.luma_only) {
+			int width_C = width_Y >> 1;
+			i8x16 shuf = load64(shift_C_8bit + 7 + clip3(-7, 0, xInt_C) + clip3(0, 7, xInt_C + 8 - width_C));
+			src0 = ref + clip3(0, width_C - 8, xInt_C);
+			src1 = ref + clip3(0, width_C - 1, xInt_C + 8);
+			for (int j = 0; j <= h >> 1; j++, yInt_C++) {
+				int cb = ctx->t.plane_size_Y + clip3(0, ctx->t.plane_size_C - sstride_C * 2, yInt_C * sstride_C * 2);
+				int cr = sstride_C + cb;
+				// reads are split in 2 to support 8px-wide frames
+				ctx->edge_buf_l[j * 4 + 84] = ((i64x2)shuffle(load64(src0 + cb), shuf))[0];
+				ctx->edge_buf[j * 32 + 680] = *(src1 + cb);
+				ctx->edge_buf_l[j * 4 + 86] = ((i64x2)shuffle(load64(src0 + cr), shuf))[0];
+				ctx->edge_buf[j * 32 + 696] = *(src1 + cr);
+			}
+			sstride_C = 16;
+			src_C = ctx->edge_buf + 672;
 		}
-		sstride_C = 16;
-		src_C = ctx->edge_buf + 672;
 	}
 	
 	// chroma prediction comes first since it can be inlined
-	uint8_t *dst_C = ctx->samples_mb[1] + (y444[i4x4] >> 1) * ctx->t.stride[1] + (x444[i4x4] >> 1);
-	size_t dstride_C = ctx->t.stride[1] >> 1;
-	int xFrac_C = x & 7;
-	int yFrac_C = y & 7;
-	i32x4 ABCD = {little_endian32(((8 - xFrac_C) | xFrac_C << 8) * ((8 - yFrac_C) | yFrac_C << 16))};
-	decode_inter_chroma(w, h, dstride_C, dst_C, sstride_C, src_C, ABCD, wod);
+	if (!ctx->t.luma_only) {
+		uint8_t *dst_C = ctx->samples_mb[1] + (y444[i4x4] >> 1) * ctx->t.stride[1] + (x444[i4x4] >> 1);
+		size_t dstride_C = ctx->t.stride[1] >> 1;
+		int xFrac_C = x & 7;
+		int yFrac_C = y & 7;
+		i32x4 ABCD = {little_endian32(((8 - xFrac_C) | xFrac_C << 8) * ((8 - yFrac_C) | yFrac_C << 16))};
+		decode_inter_chroma(w, h, dstride_C, dst_C, sstride_C, src_C, ABCD, wod);
+	}
 	
 	// tail jump to luma prediction
 	int xFrac_Y = x & 3;
@@ -13,7 +13,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#ifndef _WIN32
+	#include <sys/mman.h>
+#endif
 
 #include "edge264.h"
 
@@ -31,6 +35,7 @@ typedef uint8_t u8x16 __attribute__((vector_size(16)));
 typedef uint16_t u16x8 __attribute__((vector_size(16)));
 typedef uint32_t u32x4 __attribute__((vector_size(16)));
 typedef uint64_t u64x2 __attribute__((vector_size(16)));
+typedef float f32x4 __attribute__((vector_size(16)));
 typedef int8_t i8x32 __attribute__((vector_size(32))); // alignment for 256-bit extensions
 typedef int16_t i16x16 __attribute__((vector_size(32)));
 typedef int32_t i32x8 __attribute__((vector_size(32)));
@@ -95,13 +100,15 @@ typedef struct {
 	int8_t mbIsInterFlag;
 	int8_t filter_edges; // bits 0-1 enable deblocking of A/B edges, bit 2 signals that deblocking is pending
 	union { uint8_t QP[3]; i8x4 QP_s; }; // [iYCbCr]
+	int8_t FilterOffsetA; // slice values needed to deblock the mb outside of its slice
+	int8_t FilterOffsetB;
+	int8_t entropy_coding_mode_flag;
 	union { uint32_t bits[2]; uint64_t bits_l; }; // {cbp/ref_idx_nz, cbf_Y/Cb/Cr 8x8}
 	union { int8_t refIdx[8]; int32_t refIdx_s[2]; int64_t refIdx_l; }; // [LX][i8x8]
 	union { int8_t refPic[8]; int32_t refPic_s[2]; int64_t refPic_l; }; // [LX][i8x8]
 	Edge264MbFlags f;
 	union { int8_t Intra4x4PredMode[16]; i8x16 Intra4x4PredMode_v; }; // [i4x4]
 	union { int8_t nC[3][16]; int32_t nC_s[3][4]; int64_t nC_l[6]; i8x16 nC_v[3]; }; // for CAVLC and deblocking, 64 if unavailable
-	union { uint8_t absMvd[64]; uint64_t absMvd_l[8]; i8x16 absMvd_v[4]; }; // [LX][i4x4][compIdx]
 	union { int16_t mvs[64]; int32_t mvs_s[32]; int64_t mvs_l[16]; i16x8 mvs_v[8]; }; // [LX][i4x4][compIdx]
 } Edge264Macroblock;
 static Edge264Macroblock unavail_mb = {
@@ -113,6 +120,18 @@ static Edge264Macroblock unavail_mb = {
 	.Intra4x4PredMode = {-2, -2, -2, -2, -2, -2, -2, -2, -2, -2, -2, -2, -2, -2, -2, -2},
 };
 
+/**
+ * Values needed only while parsing the slice of a macroblock are stored apart
+ * from the frame, in a rolling buffer of pic_width_in_mbs + 3 values covering
+ * the current macroblock and its neighbours, which is enough since neighbours
+ * outside the slice are unavailable anyway. The buffer is doubled and each
+ * macroblock is copied to the lower half once parsed, such that neighbouring
+ * offsets from the upper half stay constant across the wrap.
+ */
+typedef struct {
+	union { uint8_t absMvd[64]; uint64_t absMvd_l[8]; i8x16 absMvd_v[4]; }; // [LX][i4x4][compIdx]
+} Edge264MbParse;
+
 
 
 /**
@@ -145,7 +164,10 @@ typedef struct {
 	int8_t direct_8x8_inference_flag; // 0..1
 	int8_t num_frame_buffers; // 1..18
 	int8_t max_num_reorder_frames; // 0..17
+	int8_t max_ref_rows; // -1..33, rows of mbs below the current one reachable by vertical mvs (Table A-1), -1 for whole frames
 	int8_t mvc; // 0..1
+	int8_t video_full_range_flag; // 0..1
+	uint8_t matrix_coefficients; // 0..255, 2 if unspecified
 	int16_t offset_for_non_ref_pic; // -32768..32767, pic_order_cnt_type==1
 	int16_t offset_for_top_to_bottom_field; // -32768..32767, pic_order_cnt_type==1
 	int16_t PicOrderCntDeltas[256]; // -32768..32767, pic_order_cnt_type==1
@@ -192,6 +214,10 @@ typedef struct {
 	int8_t cabac_init_idc; // 0..3
 	int8_t next_deblock_idc; // -1..31, -1 if next_deblock_addr is not written back to dec, currPic otherwise
 	int8_t frame_flip_bit; // 0..1
+	int8_t max_ref_rows; // -1..33, copied from SPS
+	int8_t deblock_separately; // 0..1, mbs are deblocked by a separate task, to which decoding progress is published
+	int8_t parse_only; // 0..1, mbs are parsed without reconstructing samples
+	int8_t luma_only; // 0..1, chroma planes are neither allocated nor reconstructed
 	int16_t pic_width_in_mbs; // 0..1023
 	int16_t pic_height_in_mbs; // 0..1055
 	uint16_t stride[3]; // 0..65472 (at max width, 16bit & field pic), [iYCbCr]
@@ -202,7 +228,11 @@ typedef struct {
 	uint32_t long_term_flags;
 	union { int8_t QP[3]; i8x4 QP_s; }; // same as mb
 	uint8_t *samples_base;
+	Edge264Macroblock *mbs_base;
+	const Edge264Macroblock *mbs_col; // macroblocks of RefPicList[1][0] in B slices, used for direct prediction
 	uint8_t *frame_buffers[32];
+	Edge264MbInfo *mb_info; // array of exported info for the mbs of the frame, or NULL
+	uint8_t *mb_maps; // QP, type and bits planes exported for the mbs of the frame, or NULL
 	void (*free_cb)(void *free_arg, int ret); // copy from decode_NAL
 	void *free_arg; // copy from decode_NAL
 	union { uint16_t samples_clip[3][8]; i16x8 samples_clip_v[3]; }; // [iYCbCr], maximum sample value
@@ -215,6 +245,37 @@ typedef struct {
 
 
 
+/**
+ * In pipelined slices, the entropy decoder records the reconstruction of each
+ * mb as a sequence of ops, replayed row by row by other threads. Coefficients
+ * follow IDCT ops, and each row fits RECON_OPS_PER_MB * pic_width_in_mbs + 1
+ * ops (at most 32 inter partitions, 16 intra blocks, 24 residual blocks).
+ */
+#define RECON_ROWS 8
+#define RECON_OPS_PER_MB 160
+enum ReconOpCodes {
+	OP_END, // end of row
+	OP_MB, // start of mb, waiting for its upper-right neighbour
+	OP_INTRA4x4,
+	OP_INTRA8x8,
+	OP_INTRA16x16,
+	OP_INTRA_CHROMA,
+	OP_INTER,
+	OP_IDCT4x4, // followed by 4 ops of coefficients
+	OP_DC4x4,
+	OP_IDCT8x8, // followed by 16 ops of coefficients
+};
+typedef struct {
+	int8_t op;
+	int8_t iYCbCr; // or width for OP_INTER
+	int8_t arg; // prediction mode, DCidx, or partition index for OP_INTER
+	int8_t qP; // or height for OP_INTER
+	int32_t dc; // DC coefficient, or mbx | mby << 16 for OP_MB
+	uint8_t *p; // top-left sample of the block, or macroblock for OP_MB
+} __attribute__((aligned(16))) Edge264ReconOp;
+
+
+
 /**
  * This structure stores the context data needed by each thread to decode
  * a slice, such that we can dedicate a single register pointer to it.
@@ -229,6 +290,9 @@ typedef struct Edge264Context {
 	int32_t CurrMbAddr;
 	int32_t PicOrderCnt;
 	int32_t mb_skip_run;
+	uint32_t ref_frames; // bitfield for frames whose progress is waited at each row of mbs
+	Edge264ReconOp *recon_ops; // next op to record in a pipelined slice, NULL when reconstructing inline
+	size_t mb_bits_pos; // bit position at the end of the previous mb, when exporting mb_maps
 	uint8_t *samples_mb[3]; // address of top-left byte of each plane in current macroblock
 	Edge264Macroblock * _mb; // backup storage for macro mb
 	const Edge264Macroblock * _mbA; // backup storage for macro mbA
@@ -236,6 +300,8 @@ typedef struct Edge264Context {
 	const Edge264Macroblock * _mbC; // backup storage for macro mbC
 	const Edge264Macroblock * _mbD; // backup storage for macro mbD
 	const Edge264Macroblock *mbCol;
+	Edge264MbParse * _mbp; // backup storage for macro mbp
+	Edge264MbParse *mbp_ring; // 2 * (pic_width_in_mbs + 3) values in dec->mbp_rings, owned by the task
 	Edge264Decoder *d;
 	FILE *trace_slices;
 	Edge264MbFlags inc; // increments for CABAC indices of macroblock syntax elements
@@ -284,31 +350,71 @@ typedef struct Edge264Context {
 #define mbB ctx->_mbB
 #define mbC ctx->_mbC
 #define mbD ctx->_mbD
+#define mbp ctx->_mbp
+
+
+
+/**
+ * State of the slice being pipelined, whose rows of mbs are reconstructed
+ * behind its entropy decoding by any thread running the reconstruction task.
+ * Rows are counted from the first row of the slice, and each one is stored
+ * in ops[n % RECON_ROWS * row_ops]. All fields are protected by dec->lock
+ * except progress.
+ */
+typedef struct {
+	Edge264ReconOp *ops;
+	int32_t row_ops; // capacity of each row of ops
+	int8_t done[RECON_ROWS]; // rows reconstructed out of order
+	int32_t first_row; // mby of the first row of the slice
+	int32_t end_addr; // CurrMbAddr at the end of the slice, INT_MAX until then
+	int32_t rows_parsed;
+	int32_t rows_claimed;
+	int32_t rows_done; // all rows up to this one are reconstructed
+	int32_t waiters; // threads waiting on progress
+	int32_t progress[RECON_ROWS]; // next mbx to reconstruct in each row, atomic
+	union { uint8_t implicit_weights[32][32]; i8x16 implicit_weights_v[32][2]; }; // copied from the entropy decoder
+} Edge264Pipeline;
 
 
 
 /**
  * This structure stores all variables scoped to the entire stream.
+ * 
+ * Tasks in flight are tracked with 64-bit masks, which bounds the number of
+ * slices being decoded in parallel, thus the number of useful threads. The cap
+ * is fixed rather than set at allocation, such that picking, releasing and
+ * dependency checks stay single-word operations under dec->lock. It is not a
+ * limit on streams: further slices wait for a free slot (or get EWOULDBLOCK),
+ * and a pool larger than 64 threads spreads over several decoders. Each slot
+ * costs sizeof(Edge264Task) and one mbp ring, so lowering it saves little.
  */
+#define MAX_TASKS 64
+#define STREAM_BUFFER_SIZE (1 << 20) // initial size of the buffer reassembling NAL units from chunks
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
 typedef int (*Parser)(Edge264Decoder *dec, int non_blocking, void(*free_cb)(void*,int), void *free_arg);
 typedef struct Edge264Decoder {
 	Edge264GetBits _gb; // must be first in the struct to use the same pointer for bitstream functions
-	int8_t n_threads; // 0 to disable multithreading
+	int8_t n_threads; // 0 to disable multithreading, up to MAX_TASKS
 	int8_t nal_ref_idc; // 2 significant bits
 	int8_t nal_unit_type; // 5 significant bits
+	int8_t nal_end_known; // 1 if the NAL end was given by a length prefix, thus needs no start code scan
 	int8_t IdrPicFlag; // 1 significant bit
 	int8_t currPic; // index of current incomplete frame, or -1
 	int8_t basePic; // index of last MVC base view, or -1
 	int32_t plane_size_Y;
 	int32_t plane_size_C;
-	int32_t frame_size;
+	int32_t frame_size; // planes and a tail for overreads, macroblocks are allocated apart
+	int32_t mbs_size;
+	int32_t frame_capacity; // size of allocated frame buffers, the highest frame_size since the last trim
 	int32_t FrameNum; // value for the current incomplete frame, unaffected by mmco5
 	int32_t prevRefFrameNum[2];
 	int32_t TopFieldOrderCnt; // same
 	int32_t BottomFieldOrderCnt;
 	int32_t prevPicOrderCnt;
 	int32_t dispPicOrderCnt; // all POCs lower or equal than this are ready for output
+	uint32_t poc_epoch; // incremented at each IDR or mmco5, since POCs of later frames restart from 0
 	int32_t FrameNums[32];
+	uint32_t FrameEpochs[32]; // value of poc_epoch for each frame, ordering the POCs of tasks across resets
 	uint32_t reference_flags; // bitfield for indices of reference frames/views
 	uint32_t long_term_flags; // bitfield for indices of long-term frames/views
 	uint32_t output_flags; // bitfield for frames waiting to be output
@@ -322,32 +428,112 @@ typedef struct Edge264Decoder {
 	FILE *trace_slices;
 #endif
 	uint8_t *frame_buffers[32];
+	Edge264Macroblock *frame_mbs[32]; // held by frames while decoded or referenced, then lent to the next frames
+	int8_t prealloc_mode; // Edge264PreallocMode applied at each SPS activation
+	uint32_t locked_flags; // bitfield for frame buffers locked in memory with mlock
+	int8_t huge_pages; // back new frame buffers with 2MB pages
+	uint32_t hugetlb_flags; // bitfield for frame buffers mapped with MAP_HUGETLB, to be released with munmap
+	void *(*alloc_cb)(void *alloc_arg, size_t size); // custom allocator for frame buffers, malloc if NULL
+	void (*dealloc_cb)(void *alloc_arg, void *ptr);
+	void *alloc_arg;
+	void (*output_cb)(void *output_arg, const Edge264Frame *frame); // if not NULL, receives each frame once ready for output
+	void *output_arg;
+	int8_t output_borrow; // frames passed to output_cb are borrowed, like with edge264_get_frame
+	int8_t skip_mode; // Edge264SkipMode applied to pictures before creating any task
+	int8_t refs_dropped; // a reference picture was dropped, thus all non-IDR pictures are dropped until the next IDR
+	int8_t deblock_mode; // Edge264DeblockMode overriding disable_deblocking_filter_idc
+	int8_t deadline_level; // 0..3, degradation steps applied on top of skip_mode and deblock_mode
+	int32_t pictures_dropped; // pictures dropped since the last one allocated in the DPB
+	int64_t deadline_period; // expected time between pictures in ns, or 0 to disable adaptation
+	int64_t deadline_next; // CLOCK_MONOTONIC time in ns at which the next picture is expected
+	int8_t frame_deadline_levels[32]; // deadline_level when each frame was decoded
+	uint16_t frame_pictures_dropped[32]; // pictures dropped before each frame in decoding order
+	uint32_t frame_ref_flags; // bitfield for frames with nal_ref_idc != 0 in any of their fields
+	int8_t mb_info_mode; // Edge264MbInfoMode applied to each new frame
+	uint32_t mb_info_flags; // bitfield for frames whose mb_infos are filled during decoding
+	uint32_t parse_only_flags; // bitfield for frames decoded without reconstructing samples
+	Edge264MbInfo *mb_infos[32]; // allocated on the first frame exporting mb info in each slot
+	int8_t mb_maps_enabled;
+	uint32_t mb_maps_flags; // bitfield for frames whose mb_maps are filled during decoding
+	uint8_t *mb_maps[32]; // QP, type and bits planes, allocated like mb_infos
+	int8_t luma_only; // drop chroma planes at the next frame format change
+	int8_t format_luma_only; // luma_only applied to the current frame format, which may have no chroma planes anyway (4:0:0)
+	int8_t scale_shift; // 0..2, log2 of the downscaling applied to each new frame
+	int8_t output_format; // Edge264OutputFormat applied to each new frame
+	uint32_t convert_flags; // bitfield for frames downscaled or converted during decoding
+	int8_t frame_scale_shifts[32]; // scale_shift when each frame was decoded
+	int8_t frame_output_formats[32]; // output_format when each frame was decoded
+	int16_t converted_rows[32]; // rows of mbs already downscaled/converted in each frame
+	uint8_t *scaled_buffers[32]; // downscaled planes, allocated like mb_infos
+	uint8_t *converted_buffers[32]; // converted frames, allocated with alloc_cb like frame buffers
+	int8_t probe_only; // context from edge264_probe_alloc, keeping parameter sets without any frame or task
+	int8_t probe_ref; // 1 if the picture being probed is a reference
+	int32_t probe_prevRefFrameNum[2]; // POC decoding state of edge264_probe_NAL, separate from decoding
+	int32_t probe_prevPicOrderCnt;
+	int32_t probe_PicOrderCnt;
 	Parser parse_nal_unit[32];
+	int (*decode_task)(Edge264Decoder *dec); // variant used by the threads of a shared pool
+	int (*convert_tensor)(const Edge264Frame *frame, float *tensor, const float *mean, const float *std, int bgr);
+	int (*probe_slice_header)(Edge264Decoder *dec, Edge264NalInfo *info);
 	union { int8_t LongTermFrameIdx[32]; i8x16 LongTermFrameIdx_v[2]; };
 	union { int8_t pic_LongTermFrameIdx[32]; i8x16 pic_LongTermFrameIdx_v[2]; }; // to be applied after decoding all slices of the current frame
 	union { int32_t FieldOrderCnt[2][32]; i32x4 FieldOrderCnt_v[2][8]; }; // lower/higher half for top/bottom fields
 	Edge264Frame out;
 	Edge264SeqParameterSet sps;
 	Edge264PicParameterSet PPS[4];
-	pthread_t threads[16];
+	pthread_t threads[MAX_TASKS];
+	int8_t exit_flag; // set by edge264_free to terminate all threads
+	Edge264Pool *pool; // if not NULL, tasks are consumed by the threads of this pool instead
+	Edge264Decoder *pool_next; // linked list of decoders attached to the same pool
+	int pool_refs; // number of pool threads holding a pointer to this decoder, protected by pool->lock
+	uint8_t *stream_buf; // bytes received by edge264_decode_chunk, where each NAL unit is kept contiguous
+	int32_t stream_size; // allocated size of stream_buf
+	int32_t stream_start; // first byte of the next NAL unit to decode
+	int32_t stream_end; // first byte past the bytes received
+	int32_t stream_scan; // first byte where to resume the search for a start code
+	int8_t stream_synced; // 0 until the first start code was found
 	
 	// fields accessed concurrently from multiple threads
 	pthread_mutex_t lock;
 	pthread_cond_t task_ready;
 	pthread_cond_t task_progress; // signals next_deblock_addr has been updated
 	pthread_cond_t task_complete;
-	uint16_t busy_tasks; // bitmask for tasks that are either pending or processed in a thread
-	uint16_t pending_tasks;
-	uint16_t ready_tasks;
+	uint64_t busy_tasks; // bitmask for tasks that are either pending or processed in a thread
+	uint64_t pending_tasks;
+	uint64_t ready_tasks; // written with lock held, read atomically by pool threads holding only pool->lock
+	uint64_t reference_tasks; // bitmask for slice tasks of reference pictures, which are picked first (subset of busy_tasks)
+	uint64_t deblock_tasks; // bitmask for tasks deblocking a frame behind the slices decoding it, which are picked before all
+	uint64_t recon_tasks; // bitmask for the task reconstructing the pipelined slice, also picked before all
 	int32_t remaining_mbs[32]; // when zero the picture is complete
 	union { int32_t next_deblock_addr[32]; i32x4 next_deblock_addr_v[8]; }; // next CurrMbAddr value for which mbB will be deblocked
-	volatile union { uint32_t task_dependencies[16]; i32x4 task_dependencies_v[4]; }; // frames on which each task depends to start
-	union { int8_t taskPics[16]; i8x16 taskPics_v; }; // values of currPic for each task
-	Edge264Task tasks[16];
+	int32_t next_decode_addr[32]; // next CurrMbAddr value to be decoded contiguously from the start of frame, with separate deblocking
+	volatile union { uint32_t task_dependencies[MAX_TASKS]; i32x4 task_dependencies_v[MAX_TASKS / 4]; }; // frames on which each task depends to start
+	union { int8_t taskPics[MAX_TASKS]; i8x16 taskPics_v[MAX_TASKS / 16]; }; // values of currPic for each task
+	Edge264Task tasks[MAX_TASKS];
+	Edge264Pipeline pipe;
+	Edge264MbParse *mbp_rings; // 2 * (pic_width_in_mbs + 3) values for each task, reallocated on format change
+	Edge264Stats stats; // protected by lock
+	int32_t stream_holds[MAX_TASKS + 1]; // 1 + offsets in stream_buf of NAL units not yet released by free_cb, or 0
 } Edge264Decoder;
 
 
 
+/**
+ * This structure stores a set of worker threads shared by many decoders, such
+ * that their tasks are all consumed by the same threads.
+ */
+typedef struct Edge264Pool {
+	int16_t n_threads; // 1..1024
+	int8_t exit_flag; // set by edge264_pool_free to terminate all threads
+	pthread_mutex_t lock;
+	pthread_cond_t task_ready; // signals any attached decoder has ready tasks
+	pthread_cond_t released; // signals pool_refs was decremented for any decoder
+	Edge264Decoder *decoders; // first attached decoder, in round-robin order
+	pthread_t threads[];
+} Edge264Pool;
+
+
+
 #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
 	#define little_endian32(x) (x)
 	#define little_endian64(x) (x)
@@ -365,6 +551,7 @@ typedef struct Edge264Decoder {
 	#define ctz32 __builtin_ctz
 	#define clz64 __builtin_clzll
 	#define ctz64 __builtin_ctzll
+	#define popcount64 __builtin_popcountll
 	#ifndef WORD_BIT
 		#define WORD_BIT 32
 	#endif
@@ -863,28 +1050,111 @@ static always_inline unsigned refs_to_mask(Edge264Task *t) {
 	u32x4 i = h | (u32x4)shr128(h, 4);
 	return i[0];
 }
-static always_inline unsigned ready_frames(Edge264Decoder *c) {
-	i32x4 last = set32(INT_MAX);
-	i16x8 a = packs32(c->next_deblock_addr_v[0] == last, c->next_deblock_addr_v[1] == last);
-	i16x8 b = packs32(c->next_deblock_addr_v[2] == last, c->next_deblock_addr_v[3] == last);
-	i16x8 d = packs32(c->next_deblock_addr_v[4] == last, c->next_deblock_addr_v[5] == last);
-	i16x8 e = packs32(c->next_deblock_addr_v[6] == last, c->next_deblock_addr_v[7] == last);
+static always_inline int ref_progress_needed(const Edge264Task *t, int mby) {
+	// rows up to mby+max_ref_rows are final once the row below them is deblocked
+	return t->max_ref_rows < 0 ? INT_MAX : (mby + t->max_ref_rows + 2) * t->pic_width_in_mbs;
+}
+static always_inline unsigned progressed_frames(Edge264Decoder *c, int next_deblock_addr) {
+	i32x4 last = set32(next_deblock_addr - 1);
+	i16x8 a = packs32(c->next_deblock_addr_v[0] > last, c->next_deblock_addr_v[1] > last);
+	i16x8 b = packs32(c->next_deblock_addr_v[2] > last, c->next_deblock_addr_v[3] > last);
+	i16x8 d = packs32(c->next_deblock_addr_v[4] > last, c->next_deblock_addr_v[5] > last);
+	i16x8 e = packs32(c->next_deblock_addr_v[6] > last, c->next_deblock_addr_v[7] > last);
 	return movemask(packs16(a, b)) | movemask(packs16(d, e)) << 16;
 }
-static always_inline unsigned ready_tasks(Edge264Decoder *c) {
-	i32x4 not_ready = ~set32(ready_frames(c));
-	i32x4 a = (c->task_dependencies_v[0] & not_ready) == 0;
-	i32x4 b = (c->task_dependencies_v[1] & not_ready) == 0;
-	i32x4 d = (c->task_dependencies_v[2] & not_ready) == 0;
-	i32x4 e = (c->task_dependencies_v[3] & not_ready) == 0;
-	return c->pending_tasks & movemask(packs16(packs32(a, b), packs32(d, e)));
+static always_inline uint64_t frame_tasks(Edge264Decoder *c, int pic) {
+	i8x16 p = set8(pic);
+	uint64_t m = 0;
+	for (int i = 0; i < MAX_TASKS / 16; i++)
+		m |= (uint64_t)movemask(c->taskPics_v[i] == p) << i * 16;
+	return m;
+}
+static always_inline int deblock_limit(Edge264Decoder *c, const Edge264Task *t, int pic) {
+	// like inline deblocking, mbB is deblocked only once its lower neighbour is decoded
+	int total = t->pic_width_in_mbs * t->pic_height_in_mbs;
+	int decoded = c->next_decode_addr[pic];
+	return decoded >= total ? total : decoded - t->pic_width_in_mbs;
+}
+static always_inline uint64_t ready_tasks(Edge264Decoder *c) {
+	// a task may start once all tasks of its refs are running, which prevents deadlocks between waiting threads
+	unsigned pending_frames = 0;
+	uint64_t pending_slices = c->pending_tasks & ~(c->deblock_tasks | c->recon_tasks);
+	for (uint64_t p = pending_slices; p; p &= p - 1)
+		pending_frames |= 1 << c->taskPics[ctz64(p)];
+	uint64_t ready = 0;
+	for (uint64_t p = pending_slices; p; p &= p - 1) {
+		int i = ctz64(p);
+		const Edge264Task *t = c->tasks + i;
+		int needed = ref_progress_needed(t, (unsigned)t->first_mb_in_slice / (unsigned)t->pic_width_in_mbs);
+		ready |= (uint64_t)((c->task_dependencies[i] & (pending_frames | ~progressed_frames(c, needed))) == 0) << i;
+	}
+	
+	// deblocking tasks wait for a full row of mbs to deblock, the end of frame, or the end of all its slices
+	for (uint64_t p = c->pending_tasks & c->deblock_tasks; p; p &= p - 1) {
+		int i = ctz64(p);
+		const Edge264Task *t = c->tasks + i;
+		int start = c->next_deblock_addr[c->taskPics[i]];
+		int end = deblock_limit(c, t, c->taskPics[i]);
+		ready |= (uint64_t)(end - start >= t->pic_width_in_mbs ||
+			(end > start && end == t->pic_width_in_mbs * t->pic_height_in_mbs) ||
+			!(frame_tasks(c, c->taskPics[i]) & ~c->deblock_tasks)) << i;
+	}
+	
+	// the reconstruction task is ready while rows are parsed and not yet claimed by a thread
+	if (c->pipe.rows_claimed < c->pipe.rows_parsed)
+		ready |= c->pending_tasks & c->recon_tasks;
+	return ready;
+}
+static always_inline uint64_t publish_ready_tasks(Edge264Decoder *dec) {
+	// written with dec->lock held, but read without it by pool threads looking for a decoder to serve
+	uint64_t ready = ready_tasks(dec);
+	__atomic_store_n(&dec->ready_tasks, ready, __ATOMIC_RELEASE);
+	return ready;
+}
+static always_inline void signal_ready_tasks(Edge264Decoder *dec) {
+	// many tasks may have become ready at once, so wake all threads like with owned workers
+	if (dec->pool == NULL) {
+		pthread_cond_broadcast(&dec->task_ready);
+	} else {
+		pthread_mutex_lock(&dec->pool->lock);
+		pthread_cond_broadcast(&dec->pool->task_ready);
+		pthread_mutex_unlock(&dec->pool->lock);
+	}
+}
+static always_inline Edge264ReconOp *record_op(Edge264Context *ctx, int op, int iYCbCr, int arg, void *p) {
+	Edge264ReconOp *o = ctx->recon_ops;
+	o->op = op;
+	o->iYCbCr = iYCbCr;
+	o->arg = arg;
+	o->p = p;
+	ctx->recon_ops = o + 1;
+	return o;
+}
+static always_inline void export_mb_info(Edge264Context *ctx) {
+	Edge264MbInfo *m = ctx->t.mb_info + ctx->CurrMbAddr;
+	memcpy(m->mvs, mb->mvs, sizeof(m->mvs));
+	memcpy(m->Intra4x4PredMode, mb->Intra4x4PredMode, sizeof(m->Intra4x4PredMode));
+	memcpy(m->refIdx, mb->refIdx, sizeof(m->refIdx));
+	memcpy(m->QP, mb->QP, sizeof(m->QP));
+	m->mbIsInterFlag = mb->mbIsInterFlag;
+	m->mb_skip_flag = mb->f.mb_skip_flag;
+	m->mb_type_I_NxN = mb->f.mb_type_I_NxN;
+	m->transform_size_8x8_flag = mb->f.transform_size_8x8_flag;
+	m->reserved = 0;
 }
 static always_inline unsigned depended_frames(Edge264Decoder *dec) {
 	u32x4 a = dec->task_dependencies_v[0] | dec->task_dependencies_v[1] |
 	          dec->task_dependencies_v[2] | dec->task_dependencies_v[3];
+	for (int i = 4; i < MAX_TASKS / 4; i += 4)
+		a |= dec->task_dependencies_v[i] | dec->task_dependencies_v[i + 1] |
+		     dec->task_dependencies_v[i + 2] | dec->task_dependencies_v[i + 3];
 	u32x4 b = a | (u32x4)shr128(a, 8);
 	u32x4 c = b | (u32x4)shr128(b, 4);
-	return c[0];
+	// a frame may be fully deblocked before its last slice is released, so its own tasks keep it too
+	unsigned frames = c[0];
+	for (uint64_t t = dec->busy_tasks; t; t &= t - 1)
+		frames |= 1 << dec->taskPics[ctz64(t)];
+	return frames;
 }
 
 
@@ -945,9 +1215,24 @@ static void parse_slice_data_cavlc(Edge264Context *ctx);
 static void parse_slice_data_cabac(Edge264Context *ctx);
 
 // edge264_headers.c
+static noinline void signal_progress(Edge264Context *ctx, int next_deblock_addr);
+static noinline void wait_ref_progress(Edge264Context *ctx);
+static noinline void publish_recon_row(Edge264Context *ctx);
 #ifndef ADD_VARIANT
 	#define ADD_VARIANT(f) f
 #endif
+int decode_task(Edge264Decoder *dec);
+int decode_task_v2(Edge264Decoder *dec);
+int decode_task_v3(Edge264Decoder *dec);
+int decode_task_debug(Edge264Decoder *dec);
+int convert_tensor(const Edge264Frame *frame, float *tensor, const float *mean, const float *std, int bgr);
+int convert_tensor_v2(const Edge264Frame *frame, float *tensor, const float *mean, const float *std, int bgr);
+int convert_tensor_v3(const Edge264Frame *frame, float *tensor, const float *mean, const float *std, int bgr);
+int convert_tensor_debug(const Edge264Frame *frame, float *tensor, const float *mean, const float *std, int bgr);
+int probe_slice_header(Edge264Decoder *dec, Edge264NalInfo *info);
+int probe_slice_header_v2(Edge264Decoder *dec, Edge264NalInfo *info);
+int probe_slice_header_v3(Edge264Decoder *dec, Edge264NalInfo *info);
+int probe_slice_header_debug(Edge264Decoder *dec, Edge264NalInfo *info);
 void *worker_loop(Edge264Decoder *d);
 void *worker_loop_v2(Edge264Decoder *d);
 void *worker_loop_v3(Edge264Decoder *d);
@@ -0,0 +1,288 @@
+#include "edge264_internal.h"
+
+
+
+/**
+ * Strides of the downscaled planes, with rows padded to multiples of 16 and
+ * rows of Cb and Cr interleaved like in frame buffers.
+ */
+static always_inline int scaled_stride_Y(Edge264Decoder *dec, int shift) {
+	return ((dec->out.width_mbs * 16 >> shift) + 15) & -16;
+}
+static always_inline int scaled_stride_C(Edge264Decoder *dec, int shift) {
+	return (((dec->out.width_mbs * 8 >> shift) + 15) & -16) * 2;
+}
+static always_inline size_t scaled_size(Edge264Decoder *dec, int shift) {
+	return (size_t)scaled_stride_Y(dec, shift) * (dec->out.height_mbs * 16 >> shift) +
+		(dec->plane_size_C > 0 ? (size_t)scaled_stride_C(dec, shift) * (dec->out.height_mbs * 8 >> shift) : 0);
+}
+
+/**
+ * Strides and sizes of converted frames, NV12 planes sharing the same stride.
+ */
+static always_inline int converted_stride(Edge264Decoder *dec, int format) {
+	return dec->out.width_mbs * (format == EDGE264_FORMAT_NV12 ? 16 : format == EDGE264_FORMAT_YUYV ? 32 : 48);
+}
+static always_inline size_t converted_size(Edge264Decoder *dec, int format) {
+	return (size_t)converted_stride(dec, format) * dec->out.height_mbs * (format == EDGE264_FORMAT_NV12 ? 24 : 16);
+}
+
+
+
+/**
+ * Downscales a plane by averaging each block of 2x2 or 4x4 samples.
+ *
+ * Input rows are read by chunks of 32 or 64 samples, and the samples past
+ * width only produce padding at the end of output rows, which are thus padded
+ * to multiples of 16. Reading past the last row of a plane is harmless since
+ * the next plane or the mbs array follows in the frame buffer.
+ */
+static void scale_plane(uint8_t *dst, size_t dstride, const uint8_t *src, size_t sstride, int width, int height, int shift) {
+	if (shift == 1) {
+		for (int y = 0; y < height; y += 2, src += sstride * 2, dst += dstride) {
+			for (int x = 0; x < width; x += 32) {
+				u16x8 a0 = (u16x8)load128(src + x);
+				u16x8 a1 = (u16x8)load128(src + x + 16);
+				u16x8 b0 = (u16x8)load128(src + sstride + x);
+				u16x8 b1 = (u16x8)load128(src + sstride + x + 16);
+				u16x8 s0 = (a0 & 255) + (a0 >> 8) + (b0 & 255) + (b0 >> 8);
+				u16x8 s1 = (a1 & 255) + (a1 >> 8) + (b1 & 255) + (b1 >> 8);
+				*(i8x16 *)(dst + x / 2) = packus16(shrru16(s0, 2), shrru16(s1, 2));
+			}
+		}
+	} else {
+		for (int y = 0; y < height; y += 4, src += sstride * 4, dst += dstride) {
+			for (int x = 0; x < width; x += 64) {
+				i32x4 s[4];
+				for (int i = 0; i < 4; i++) {
+					u16x8 h = {};
+					for (int j = 0; j < 4; j++) {
+						u16x8 v = (u16x8)load128(src + sstride * j + x + i * 16);
+						h += (v & 255) + (v >> 8);
+					}
+					s[i] = (i32x4)((((u32x4)h & 0xffff) + ((u32x4)h >> 16) + 8) >> 4);
+				}
+				*(i8x16 *)(dst + x / 4) = packus16(packs32(s[0], s[1]), packs32(s[2], s[3]));
+			}
+		}
+	}
+}
+
+
+
+/**
+ * Computes the factors converting YCbCr samples to R, G and B values in
+ * 0..255, as {Y, Cb, Cr, 1} for each component (equations E-28 to E-33).
+ * Unspecified matrices are assumed BT.709 for HD and BT.601 otherwise.
+ */
+static void rgb_matrix(float m[3][4], int matrix_coefficients, int full_range, int width) {
+	float Kr = 0.299f, Kb = 0.114f;
+	if (matrix_coefficients == 1 || (matrix_coefficients == 2 && width >= 1280)) {
+		Kr = 0.2126f, Kb = 0.0722f;
+	} else if (matrix_coefficients == 9 || matrix_coefficients == 10) {
+		Kr = 0.2627f, Kb = 0.0593f;
+	}
+	float Kg = 1 - Kr - Kb;
+	float y = full_range ? 1 : 255.f / 219;
+	float c = full_range ? 1 : 255.f / 224;
+	float y0 = full_range ? 0 : -16 * y;
+	float rv = 2 * (1 - Kr) * c;
+	float bu = 2 * (1 - Kb) * c;
+	float gu = -bu * Kb / Kg;
+	float gv = -rv * Kr / Kg;
+	float rgb[3][4] = {
+		{y, 0, rv, y0 - rv * 128},
+		{y, gu, gv, y0 - (gu + gv) * 128},
+		{y, bu, 0, y0 - bu * 128}};
+	memcpy(m, rgb, sizeof(rgb));
+}
+
+/**
+ * Converts 8 samples to RGB in 0..255 (unclamped), with chroma samples
+ * repeated horizontally, given the low 8 bytes of luma and low 4 bytes of
+ * each chroma.
+ */
+static always_inline void yuv_to_rgb(const float m[3][4], i8x16 y8, i8x16 cb8, i8x16 cr8, f32x4 rgb[3][2]) {
+	i16x8 y16 = cvtlo8u16(y8);
+	i16x8 cb16 = cvtlo8u16(ziplo8(cb8, cb8));
+	i16x8 cr16 = cvtlo8u16(ziplo8(cr8, cr8));
+	f32x4 y[2] = {__builtin_convertvector((i32x4)cvtlo16u32(y16), f32x4), __builtin_convertvector((i32x4)cvthi16u32(y16), f32x4)};
+	f32x4 cb[2] = {__builtin_convertvector((i32x4)cvtlo16u32(cb16), f32x4), __builtin_convertvector((i32x4)cvthi16u32(cb16), f32x4)};
+	f32x4 cr[2] = {__builtin_convertvector((i32x4)cvtlo16u32(cr16), f32x4), __builtin_convertvector((i32x4)cvthi16u32(cr16), f32x4)};
+	for (int i = 0; i < 3; i++) {
+		for (int j = 0; j < 2; j++)
+			rgb[i][j] = y[j] * m[i][0] + cb[j] * m[i][1] + cr[j] * m[i][2] + m[i][3];
+	}
+}
+
+static always_inline f32x4 clamp255f(f32x4 v) {
+	i32x4 lo = (i32x4)v & (v > 0);
+	i32x4 hi = v < 255;
+	return (f32x4)((lo & hi) | ((i32x4)(f32x4){255, 255, 255, 255} & ~hi));
+}
+
+
+
+/**
+ * Converts rows of mbs to NV12 (Y plane then interleaved CbCr plane), YUYV
+ * (packed samples, each chroma row repeated on 2 rows) or packed RGB/BGR.
+ * Luma-only frames get neutral chroma.
+ */
+static void convert_format(Edge264Decoder *dec, int currPic, int row, int rows) {
+	int width = dec->out.width_mbs * 16;
+	size_t sstride_Y = dec->out.stride_Y;
+	size_t sstride_C = dec->out.stride_C;
+	size_t dstride = converted_stride(dec, dec->frame_output_formats[currPic]);
+	const uint8_t *src_Y = dec->frame_buffers[currPic] + sstride_Y * row * 16;
+	const uint8_t *src_C = dec->frame_buffers[currPic] + dec->plane_size_Y + sstride_C * row * 8;
+	uint8_t *dst = dec->converted_buffers[currPic];
+	if (dec->frame_output_formats[currPic] == EDGE264_FORMAT_NV12) {
+		for (int y = row * 16; y < rows * 16; y++, src_Y += sstride_Y)
+			memcpy(dst + dstride * y, src_Y, width);
+		dst += dstride * dec->out.height_mbs * 16;
+		for (int y = row * 8; y < rows * 8; y++, src_C += sstride_C) {
+			uint8_t *d = dst + dstride * y;
+			if (dec->plane_size_C == 0) {
+				memset(d, 128, width);
+				continue;
+			}
+			int x = 0;
+			for (; x + 16 <= width >> 1; x += 16) {
+				i8x16 cb = load128(src_C + x);
+				i8x16 cr = load128(src_C + sstride_C / 2 + x);
+				*(i8x16 *)(d + x * 2) = ziplo8(cb, cr);
+				*(i8x16 *)(d + x * 2 + 16) = ziphi8(cb, cr);
+			}
+			if (x < width >> 1) // widths of 8 modulo 16 samples
+				*(i8x16 *)(d + x * 2) = ziplo8(load64(src_C + x), load64(src_C + sstride_C / 2 + x));
+		}
+	} else if (dec->frame_output_formats[currPic] >= EDGE264_FORMAT_RGB24) {
+		float m[3][4];
+		rgb_matrix(m, dec->out.matrix_coefficients, dec->out.video_full_range_flag, dec->out.width_Y);
+		int bgr = dec->frame_output_formats[currPic] == EDGE264_FORMAT_BGR24;
+		static const i8x16 drop_alpha = {0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1};
+		for (int y = row * 16; y < rows * 16; y++, src_Y += sstride_Y) {
+			uint8_t *d = dst + dstride * y;
+			const uint8_t *c = src_C + sstride_C * ((y >> 1) - row * 8);
+			for (int x = 0; x < width; x += 8) {
+				i8x16 cb = (dec->plane_size_C == 0) ? set8(-128) : (i8x16)load32(c + x / 2);
+				i8x16 cr = (dec->plane_size_C == 0) ? set8(-128) : (i8x16)load32(c + sstride_C / 2 + x / 2);
+				f32x4 rgb[3][2];
+				yuv_to_rgb(m, load64(src_Y + x), cb, cr, rgb);
+				i8x16 p[3];
+				for (int i = 0; i < 3; i++) {
+					i32x4 lo = __builtin_convertvector(rgb[i][0] + 0.5f, i32x4);
+					i32x4 hi = __builtin_convertvector(rgb[i][1] + 0.5f, i32x4);
+					i16x8 v = packs32(lo, hi);
+					p[i] = packus16(v, v);
+				}
+				i8x16 rg = ziplo8(p[bgr * 2], p[1]);
+				i8x16 ba = ziplo8(p[2 - bgr * 2], (i8x16){});
+				i8x16 lo = shuffle(ziplo16(rg, ba), drop_alpha);
+				i8x16 hi = shuffle(ziphi16(rg, ba), drop_alpha);
+				memcpy(d + x * 3, &lo, 12);
+				memcpy(d + x * 3 + 12, &hi, 12);
+			}
+		}
+	} else { // EDGE264_FORMAT_YUYV
+		for (int y = row * 16; y < rows * 16; y++, src_Y += sstride_Y) {
+			uint8_t *d = dst + dstride * y;
+			const uint8_t *c = src_C + sstride_C * ((y >> 1) - row * 8);
+			for (int x = 0; x < width; x += 16) {
+				i8x16 l = load128(src_Y + x);
+				i8x16 uv = (dec->plane_size_C == 0) ? set8(-128) : ziplo8(load64(c + x / 2), load64(c + sstride_C / 2 + x / 2));
+				*(i8x16 *)(d + x * 2) = ziplo8(l, uv);
+				*(i8x16 *)(d + x * 2 + 16) = ziphi8(l, uv);
+			}
+		}
+	}
+}
+
+
+
+/**
+ * Applies the output conversions of a frame (downscaling and format) to the
+ * rows of mbs that deblocking will not modify anymore, i.e. up to the row
+ * above next_addr (since deblocking the top edges of a row modifies the row
+ * above), or all rows if next_addr is past the frame. It is called by the
+ * single thread progressing deblocking at a time on the frame, while the rows
+ * are still in cache.
+ */
+static void convert_rows(Edge264Decoder *dec, int currPic, int next_addr) {
+	int width_mbs = dec->out.width_mbs;
+	int rows = (next_addr >= width_mbs * dec->out.height_mbs) ? dec->out.height_mbs : next_addr / width_mbs - 1;
+	int row = dec->converted_rows[currPic];
+	if (row >= rows)
+		return;
+	dec->converted_rows[currPic] = rows;
+	if (dec->frame_output_formats[currPic] != EDGE264_FORMAT_I420)
+		convert_format(dec, currPic, row, rows);
+	int shift = dec->frame_scale_shifts[currPic];
+	if (shift == 0)
+		return;
+	size_t stride_Y = scaled_stride_Y(dec, shift);
+	size_t stride_C = scaled_stride_C(dec, shift);
+	const uint8_t *src = dec->frame_buffers[currPic];
+	uint8_t *dst = dec->scaled_buffers[currPic];
+	scale_plane(dst + stride_Y * (row * 16 >> shift), stride_Y,
+		src + dec->out.stride_Y * row * 16, dec->out.stride_Y,
+		width_mbs * 16, (rows - row) * 16, shift);
+	if (dec->plane_size_C > 0) {
+		uint8_t *dst_C = dst + stride_Y * (dec->out.height_mbs * 16 >> shift) + stride_C * (row * 8 >> shift);
+		const uint8_t *src_C = src + dec->plane_size_Y + dec->out.stride_C * row * 8;
+		scale_plane(dst_C, stride_C, src_C, dec->out.stride_C, width_mbs * 8, (rows - row) * 8, shift);
+		scale_plane(dst_C + stride_C / 2, stride_C, src_C + dec->out.stride_C / 2, dec->out.stride_C, width_mbs * 8, (rows - row) * 8, shift);
+	}
+}
+
+
+
+/**
+ * Converts a cropped output frame to planar RGB (or BGR) floats, normalized
+ * as (x / 255 - mean) / std for each component, the YCbCr to RGB conversion
+ * and normalization being folded in the same factors.
+ */
+int ADD_VARIANT(convert_tensor)(const Edge264Frame *frame, float *tensor, const float *mean, const float *std, int bgr) {
+	float m[3][4], n[3][4];
+	rgb_matrix(m, frame->matrix_coefficients, frame->video_full_range_flag, frame->width_Y);
+	int w = frame->width_Y;
+	int h = frame->height_Y;
+	for (int i = 0; i < 3; i++) { // mean and std are given in output order
+		int k = bgr ? 2 - i : i;
+		float s = 1.f / (255 * (std ? std[k] : 1));
+		float o = -(mean ? mean[k] : 0) * 255 * s;
+		n[i][0] = s;
+		n[i][1] = o;
+	}
+	for (int y = 0; y < h; y++) {
+		const uint8_t *sY = frame->samples[0] + y * frame->stride_Y;
+		const uint8_t *sCb = frame->samples[1] + (y >> 1) * frame->stride_C;
+		const uint8_t *sCr = frame->samples[2] + (y >> 1) * frame->stride_C;
+		float *d[3];
+		for (int i = 0; i < 3; i++)
+			d[bgr ? 2 - i : i] = tensor + (size_t)w * h * i + (size_t)w * y;
+		int x = 0;
+		for (; x + 8 <= w; x += 8) {
+			i8x16 cb = (frame->samples[1] == NULL) ? set8(-128) : (i8x16)load32(sCb + x / 2);
+			i8x16 cr = (frame->samples[1] == NULL) ? set8(-128) : (i8x16)load32(sCr + x / 2);
+			f32x4 rgb[3][2];
+			yuv_to_rgb(m, load64(sY + x), cb, cr, rgb);
+			for (int i = 0; i < 3; i++) {
+				f32x4 lo = clamp255f(rgb[i][0]) * n[i][0] + n[i][1];
+				f32x4 hi = clamp255f(rgb[i][1]) * n[i][0] + n[i][1];
+				memcpy(d[i] + x, &lo, 16);
+				memcpy(d[i] + x + 4, &hi, 16);
+			}
+		}
+		for (; x < w; x++) { // remaining columns for widths that are not multiples of 8
+			int Y = sY[x];
+			int Cb = (frame->samples[1] == NULL) ? 128 : sCb[x >> 1];
+			int Cr = (frame->samples[1] == NULL) ? 128 : sCr[x >> 1];
+			for (int i = 0; i < 3; i++) {
+				float v = Y * m[i][0] + Cb * m[i][1] + Cr * m[i][2] + m[i][3];
+				d[i][x] = (v < 0 ? 0 : v > 255 ? 255 : v) * n[i][0] + n[i][1];
+			}
+		}
+	}
+	return 0;
+}
@@ -55,6 +55,19 @@ static const i8x8 normAdjust8x8[6] = {
  */
 static noinline void add_idct4x4(Edge264Context *ctx, int iYCbCr, int DCidx, uint8_t *p)
 {
+	// in pipelined slices, coefficients are copied for another thread instead
+	if (ctx->t.parse_only)
+		return;
+	if (ctx->recon_ops) {
+		Edge264ReconOp *o = record_op(ctx, OP_IDCT4x4, iYCbCr, DCidx, p);
+		o->qP = ctx->t.QP[iYCbCr];
+		o->dc = ctx->c[16 + (DCidx & 15)];
+		for (int i = 0; i < 4; i++)
+			((i32x4 *)ctx->recon_ops)[i] = ctx->c_v[i];
+		ctx->recon_ops += 4;
+		return;
+	}
+	
 	// loading and scaling
 	unsigned qP = ctx->t.QP[iYCbCr];
 	int sh = qP / 6;
@@ -120,6 +133,12 @@ static noinline void add_idct4x4(Edge264Context *ctx, int iYCbCr, int DCidx, uin
 }
 
 static void add_dc4x4(Edge264Context *ctx, int iYCbCr, int DCidx, uint8_t *p) {
+	if (ctx->t.parse_only)
+		return;
+	if (ctx->recon_ops) {
+		record_op(ctx, OP_DC4x4, iYCbCr, DCidx, p)->dc = ctx->c[16 + DCidx];
+		return;
+	}
 	i32x4 r = set16((ctx->c[16 + DCidx] + 32) >> 6);
 	size_t stride = ctx->t.stride[iYCbCr];
 	INIT_P();
@@ -141,6 +160,16 @@ static void add_dc4x4(Edge264Context *ctx, int iYCbCr, int DCidx, uint8_t *p) {
  */
 static void add_idct8x8(Edge264Context *ctx, int iYCbCr, uint8_t *p)
 {
+	if (ctx->t.parse_only)
+		return;
+	if (ctx->recon_ops) {
+		record_op(ctx, OP_IDCT8x8, iYCbCr, 0, p)->qP = ctx->t.QP[iYCbCr];
+		for (int i = 0; i < 16; i++)
+			((i32x4 *)ctx->recon_ops)[i] = ctx->c_v[i];
+		ctx->recon_ops += 16;
+		return;
+	}
+	
 	// loading and scaling
 	unsigned qP = ctx->t.QP[iYCbCr];
 	if (ctx->t.samples_clip[iYCbCr][0] == 255) {
@@ -327,12 +356,18 @@ static void transform_dc4x4(Edge264Context *ctx, int iYCbCr)
 	i32x4 dc3 = shrrs32(f3 * LS, 6, s32);
 	
 	// store in zigzag order if needed later ...
-	if (mb->bits[0] & 1 << 5) {
+	if (mb->bits[0] & 1 << 5 || ctx->recon_ops) {
 		ctx->c_v[4] = ziplo64(dc0, dc1);
 		ctx->c_v[5] = ziphi64(dc0, dc1);
 		ctx->c_v[6] = ziplo64(dc2, dc3);
 		ctx->c_v[7] = ziphi64(dc2, dc3);
 		
+		// in pipelined slices the prediction is not done yet, so record each block
+		if (!(mb->bits[0] & 1 << 5)) {
+			for (int i4x4 = 0; i4x4 < 16; i4x4++)
+				add_dc4x4(ctx, iYCbCr, i4x4, ctx->samples_mb[iYCbCr] + y444[i4x4] * ctx->t.stride[iYCbCr] + x444[i4x4]);
+		}
+		
 	// ... or prepare for storage in place
 	} else {
 		i32x4 r0 = (dc0 + s32) >> 6;
@@ -424,9 +459,13 @@ static void transform_dc2x2(Edge264Context *ctx)
 	i32x4 dcCr = ((i32x4)unziphi32(f0, f1) * LSr) >> 5;
 	
 	// store if needed later ...
-	if (mb->f.CodedBlockPatternChromaAC) {
+	if (mb->f.CodedBlockPatternChromaAC || ctx->recon_ops) {
 		ctx->c_v[4] = dcCb;
 		ctx->c_v[5] = dcCr;
+		if (!mb->f.CodedBlockPatternChromaAC) {
+			for (int i4x4 = 0; i4x4 < 8; i4x4++)
+				add_dc4x4(ctx, 1 + (i4x4 >> 2), i4x4, ctx->samples_mb[1 + (i4x4 >> 2)] + y420[i4x4] * ctx->t.stride[1] + x420[i4x4]);
+		}
 		
 	// ... or prepare for storage in place
 	} else {
@@ -451,7 +451,8 @@ static void CAFUNC(parse_chroma_residual)
 			ctx->scan_s = (i8x4){1, 5, 3, 7};
 			CACALL(parse_residual_block, 0, 3, token_or_cbf_Cr);
 		}
-		transform_dc2x2(ctx);
+		if (!ctx->t.luma_only)
+			transform_dc2x2(ctx);
 		
 		// Eight or sixteen 4x4 AC blocks for the Cb/Cr components
 		if (mb->f.CodedBlockPatternChromaAC) {
@@ -473,8 +474,9 @@ static void CAFUNC(parse_chroma_residual)
 					ctx->c_v[0] = ctx->c_v[1] = ctx->c_v[2] = ctx->c_v[3] = (i32x4){};
 					print_slice(ctx, "Chroma AC coeffLevels[%d]:", i4x4);
 					CACALL(parse_residual_block, 1, 15, token_or_cbf);
-					add_idct4x4(ctx, iYCbCr, i4x4, samples);
-				} else {
+					if (!ctx->t.luma_only)
+						add_idct4x4(ctx, iYCbCr, i4x4, samples);
+				} else if (!ctx->t.luma_only) {
 					add_dc4x4(ctx, iYCbCr, i4x4, samples);
 				}
 			}
@@ -602,8 +604,13 @@ static void CAFUNC(parse_NxN_residual)
 			for (int i4x4 = 0; i4x4 < 16; i4x4++) {
 				size_t stride = ctx->t.stride[iYCbCr];
 				uint8_t *samples = ctx->samples_mb[iYCbCr] + y444[i4x4] * stride + x444[i4x4];
-				if (!mb->mbIsInterFlag)
-					decode_intra4x4(Intra4x4Modes[mb->Intra4x4PredMode[i4x4]][ctx->unavail4x4[i4x4]], samples, stride, ctx->t.samples_clip_v[iYCbCr]);
+				if (!mb->mbIsInterFlag) {
+					int mode = Intra4x4Modes[mb->Intra4x4PredMode[i4x4]][ctx->unavail4x4[i4x4]];
+					if (ctx->recon_ops)
+						record_op(ctx, OP_INTRA4x4, iYCbCr, mode, samples);
+					else if (!ctx->t.parse_only)
+						decode_intra4x4(mode, samples, stride, ctx->t.samples_clip_v[iYCbCr]);
+				}
 				if (mb->bits[0] & 1 << bit8x8[i4x4 >> 2]) {
 					int nA = *((int8_t *)mb->nC[iYCbCr] + ctx->A4x4_int8[i4x4]);
 					int nB = *((int8_t *)mb->nC[iYCbCr] + ctx->B4x4_int8[i4x4]);
@@ -631,8 +638,13 @@ static void CAFUNC(parse_NxN_residual)
 			for (int i8x8 = 0; i8x8 < 4; i8x8++) {
 				size_t stride = ctx->t.stride[iYCbCr];
 				uint8_t *samples = ctx->samples_mb[iYCbCr] + y444[i8x8 * 4] * stride + x444[i8x8 * 4];
-				if (!mb->mbIsInterFlag)
-					decode_intra8x8(Intra8x8Modes[mb->Intra4x4PredMode[i8x8 * 4 + 1]][ctx->unavail4x4[i8x8 * 5]], samples, stride, ctx->t.samples_clip_v[iYCbCr]);
+				if (!mb->mbIsInterFlag) {
+					int mode = Intra8x8Modes[mb->Intra4x4PredMode[i8x8 * 4 + 1]][ctx->unavail4x4[i8x8 * 5]];
+					if (ctx->recon_ops)
+						record_op(ctx, OP_INTRA8x8, iYCbCr, mode, samples);
+					else if (!ctx->t.parse_only)
+						decode_intra8x8(mode, samples, stride, ctx->t.samples_clip_v[iYCbCr]);
+				}
 				if (mb->bits[0] & 1 << bit8x8[i8x8]) {
 					#if !CABAC
 						for (int i = 0; i < 16; i++)
@@ -733,7 +745,12 @@ static void CAFUNC(parse_intra_chroma_pred_mode)
 			mb->f.intra_chroma_pred_mode_non_zero = (mode > 0);
 		#endif
 		print_slice(ctx, "intra_chroma_pred_mode: %u\n", mode);
-		decode_intraChroma(IntraChromaModes[mode][ctx->unavail4x4[0] & 3], ctx->samples_mb[1], ctx->t.stride[1] >> 1, ctx->t.samples_clip_v[1]);
+		if (ctx->t.luma_only)
+			return;
+		if (ctx->recon_ops)
+			record_op(ctx, OP_INTRA_CHROMA, 1, IntraChromaModes[mode][ctx->unavail4x4[0] & 3], ctx->samples_mb[1]);
+		else if (!ctx->t.parse_only)
+			decode_intraChroma(IntraChromaModes[mode][ctx->unavail4x4[0] & 3], ctx->samples_mb[1], ctx->t.stride[1] >> 1, ctx->t.samples_clip_v[1]);
 	}
 }
 
@@ -804,8 +821,8 @@ static noinline void CAFUNC(parse_I_mb, int mb_type_or_ctxIdx)
 	
 	// I_NxN
 	if (CACOND(mb_type_or_ctxIdx == 0, !get_ae(ctx, mb_type_or_ctxIdx))) {
+		mb->f.mb_type_I_NxN = 1; // also exported with mb info
 		#if CABAC
-			mb->f.mb_type_I_NxN = 1;
 			print_slice(ctx, (mb_type_or_ctxIdx == 17) ? "mb_type: 5\n" : // in P slice
 								 (mb_type_or_ctxIdx == 32) ? "mb_type: 23\n" : // in B slice
 																	  "mb_type: 0\n"); // in I slice
@@ -867,7 +884,10 @@ static noinline void CAFUNC(parse_I_mb, int mb_type_or_ctxIdx)
 			{I16x16_P_8 , I16x16_DCA_8, I16x16_DCB_8, I16x16_DCAB_8},
 		};
 		mb->Intra4x4PredMode_v = (i8x16){2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2};
-		decode_intra16x16(Intra16x16Modes[mode][ctx->unavail4x4[0] & 3], ctx->samples_mb[0], ctx->t.stride[0], ctx->t.samples_clip_v[0]); // FIXME 4:4:4
+		if (ctx->recon_ops)
+			record_op(ctx, OP_INTRA16x16, 0, Intra16x16Modes[mode][ctx->unavail4x4[0] & 3], ctx->samples_mb[0]);
+		else if (!ctx->t.parse_only)
+			decode_intra16x16(Intra16x16Modes[mode][ctx->unavail4x4[0] & 3], ctx->samples_mb[0], ctx->t.stride[0], ctx->t.samples_clip_v[0]); // FIXME 4:4:4
 		CACALL(parse_intra_chroma_pred_mode);
 		CAJUMP(parse_Intra16x16_residual);
 		
@@ -895,7 +915,10 @@ static noinline void CAFUNC(parse_I_mb, int mb_type_or_ctxIdx)
 		for (int iYCbCr = 0; iYCbCr < 3; iYCbCr++) {
 			int BitDepth = ctz(ctx->t.samples_clip[iYCbCr][0] + 1);
 			for (uint8_t *p = ctx->samples_mb[iYCbCr]; y-- > 0; p += ctx->t.stride[iYCbCr]) {
-				if (BitDepth == 8) {
+				if (iYCbCr > 0 && ctx->t.luma_only) {
+					for (int x = 0; x < MbWidth; x++)
+						get_uv(&ctx->t._gb, BitDepth);
+				} else if (BitDepth == 8) {
 					((uint32_t *)p)[0] = big_endian32(get_uv(&ctx->t._gb, 32));
 					((uint32_t *)p)[1] = big_endian32(get_uv(&ctx->t._gb, 32));
 					if (MbWidth == 16) {
@@ -953,7 +976,7 @@ static i16x8 CAFUNC(parse_mvd_pair, const uint8_t *absMvd_lx, int i4x4) {
 	#if !CABAC
 		int x = get_se32(&ctx->t._gb, -32768, 32767);
 		int y = get_se32(&ctx->t._gb, -32768, 32767);
-		print_slice(ctx, "mvd[%lu]: %d,%d\n", absMvd_lx - mb->absMvd + i4x4, x, y);
+		print_slice(ctx, "mvd[%lu]: %d,%d\n", absMvd_lx - mbp->absMvd + i4x4, x, y);
 		return (i16x8){x, y};
 	#else
 		i16x8 res;
@@ -997,7 +1020,7 @@ static i16x8 CAFUNC(parse_mvd_pair, const uint8_t *absMvd_lx, int i4x4) {
 			
 			if (++i == 2) {
 				res[1] = mvd;
-				print_slice(ctx, "mvd[%lu]: %d,%d\n", absMvd_lx - mb->absMvd + i4x4, res[0], mvd);
+				print_slice(ctx, "mvd[%lu]: %d,%d\n", absMvd_lx - mbp->absMvd + i4x4, res[0], mvd);
 				return res;
 			}
 			ctxBase = 47;
@@ -1185,7 +1208,7 @@ static void CAFUNC(parse_B_sub_mb) {
 		int i = __builtin_ctz(mvd_flags);
 		int i4x4 = i & 15;
 		mb->mvs_s[i] = 0; // value pointed to when A/B/C/D are unavailable
-		uint8_t *absMvd_p = mb->absMvd + (i & 16) * 2;
+		uint8_t *absMvd_p = mbp->absMvd + (i & 16) * 2;
 		i16x8 mvd = CACALL(parse_mvd_pair, absMvd_p, i4x4);
 		
 		// branch on equality mask
@@ -1212,11 +1235,11 @@ static void CAFUNC(parse_B_sub_mb) {
 		int i8x8 = i >> 2;
 		i16x8 bits = {1, 2, 4, 8};
 		i16x8 absMvd_mask = ((i16x8){m, m, m, m, m, m, m, m} & bits) == bits;
-		i16x8 absMvd_old = (i64x2){mb->absMvd_l[i8x8]};
+		i16x8 absMvd_old = (i64x2){mbp->absMvd_l[i8x8]};
 		i16x8 mvs_mask = ziplo16(absMvd_mask, absMvd_mask);
 		i32x4 mv = mvp + mvd;
 		i16x8 mvs = broadcast32(mv, 0);
-		mb->absMvd_l[i8x8] = ((i64x2)ifelse_mask(absMvd_mask, pack_absMvd(mvd), absMvd_old))[0];
+		mbp->absMvd_l[i8x8] = ((i64x2)ifelse_mask(absMvd_mask, pack_absMvd(mvd), absMvd_old))[0];
 		mb->mvs_v[i8x8] = ifelse_mask(mvs_mask, mvs, mb->mvs_v[i8x8]);
 		decode_inter(ctx, i, widths[type], heights[type]);
 	} while (mvd_flags &= mvd_flags - 1);
@@ -1260,7 +1283,7 @@ static inline void CAFUNC(parse_B_mb)
 	mb->mbIsInterFlag = 1;
 	mb->Intra4x4PredMode_v = (i8x16){2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2};
 	#if CABAC
-		mb->absMvd_v[0] = mb->absMvd_v[1] = mb->absMvd_v[2] = mb->absMvd_v[3] = (i8x16){};
+		mbp->absMvd_v[0] = mbp->absMvd_v[1] = mbp->absMvd_v[2] = mbp->absMvd_v[3] = (i8x16){};
 	#endif
 	mb->mvs_v[0] = mb->mvs_v[1] = mb->mvs_v[2] = mb->mvs_v[3] = mb->mvs_v[4] = mb->mvs_v[5] = mb->mvs_v[6] = mb->mvs_v[7] = (i16x8){};
 	
@@ -1278,8 +1301,8 @@ static inline void CAFUNC(parse_B_mb)
 	
 	// earliest handling for B_Skip
 	if (mb_skip_flag) {
+		mb->f.mb_skip_flag = 1; // also exported with mb info
 		#if CABAC
-			mb->f.mb_skip_flag = 1;
 			mb->f.mb_type_B_Direct = 1;
 			ctx->mb_qp_delta_nz = 0;
 		#endif
@@ -1346,47 +1369,47 @@ static inline void CAFUNC(parse_B_mb)
 	if (!(flags8x8 & 0xee)) { // 16x16
 		mb->f.inter_eqs_s = little_endian32(0x1b5fbbff);
 		if (flags8x8 & 0x01) {
-			i16x8 mvd = CACALL(parse_mvd_pair, mb->absMvd, 0);
+			i16x8 mvd = CACALL(parse_mvd_pair, mbp->absMvd, 0);
 			decode_inter_16x16(ctx, mvd, 0);
 		}
 		if (flags8x8 & 0x10) {
-			i16x8 mvd = CACALL(parse_mvd_pair, mb->absMvd + 32, 0);
+			i16x8 mvd = CACALL(parse_mvd_pair, mbp->absMvd + 32, 0);
 			decode_inter_16x16(ctx, mvd, 1);
 		}
 	} else if (!(flags8x8 & 0xcc)) { // 8x16
 		mb->f.inter_eqs_s = little_endian32(0x1b1bbbbb);
 		if (flags8x8 & 0x01) {
-			i16x8 mvd = CACALL(parse_mvd_pair, mb->absMvd, 0);
+			i16x8 mvd = CACALL(parse_mvd_pair, mbp->absMvd, 0);
 			decode_inter_8x16_left(ctx, mvd, 0);
 		}
 		if (flags8x8 & 0x02) {
-			i16x8 mvd = CACALL(parse_mvd_pair, mb->absMvd, 4);
+			i16x8 mvd = CACALL(parse_mvd_pair, mbp->absMvd, 4);
 			decode_inter_8x16_right(ctx, mvd, 0);
 		}
 		if (flags8x8 & 0x10) {
-			i16x8 mvd = CACALL(parse_mvd_pair, mb->absMvd + 32, 0);
+			i16x8 mvd = CACALL(parse_mvd_pair, mbp->absMvd + 32, 0);
 			decode_inter_8x16_left(ctx, mvd, 1);
 		}
 		if (flags8x8 & 0x20) {
-			i16x8 mvd = CACALL(parse_mvd_pair, mb->absMvd + 32, 4);
+			i16x8 mvd = CACALL(parse_mvd_pair, mbp->absMvd + 32, 4);
 			decode_inter_8x16_right(ctx, mvd, 1);
 		}
 	} else { // 16x8
 		mb->f.inter_eqs_s = little_endian32(0x1b5f1b5f);
 		if (flags8x8 & 0x01) {
-			i16x8 mvd = CACALL(parse_mvd_pair, mb->absMvd, 0);
+			i16x8 mvd = CACALL(parse_mvd_pair, mbp->absMvd, 0);
 			decode_inter_16x8_top(ctx, mvd, 0);
 		}
 		if (flags8x8 & 0x04) {
-			i16x8 mvd = CACALL(parse_mvd_pair, mb->absMvd, 8);
+			i16x8 mvd = CACALL(parse_mvd_pair, mbp->absMvd, 8);
 			decode_inter_16x8_bottom(ctx, mvd, 0);
 		}
 		if (flags8x8 & 0x10) {
-			i16x8 mvd = CACALL(parse_mvd_pair, mb->absMvd + 32, 0);
+			i16x8 mvd = CACALL(parse_mvd_pair, mbp->absMvd + 32, 0);
 			decode_inter_16x8_top(ctx, mvd, 1);
 		}
 		if (flags8x8 & 0x40) {
-			i16x8 mvd = CACALL(parse_mvd_pair, mb->absMvd + 32, 8);
+			i16x8 mvd = CACALL(parse_mvd_pair, mbp->absMvd + 32, 8);
 			decode_inter_16x8_bottom(ctx, mvd, 1);
 		}
 	}
@@ -1457,7 +1480,7 @@ static void CAFUNC(parse_P_sub_mb, unsigned ref_idx_flags)
 	// loop on mvs
 	do {
 		int i = __builtin_ctz(mvd_flags);
-		i16x8 mvd = CACALL(parse_mvd_pair, mb->absMvd, i);
+		i16x8 mvd = CACALL(parse_mvd_pair, mbp->absMvd, i);
 		
 		// branch on equality mask
 		i16x8 mvp;
@@ -1482,11 +1505,11 @@ static void CAFUNC(parse_P_sub_mb, unsigned ref_idx_flags)
 		int i8x8 = i >> 2;
 		i16x8 bits = {1, 2, 4, 8};
 		i16x8 absMvd_mask = ((i16x8){m, m, m, m, m, m, m, m} & bits) == bits;
-		i16x8 absMvd_old = (i64x2){mb->absMvd_l[i8x8]};
+		i16x8 absMvd_old = (i64x2){mbp->absMvd_l[i8x8]};
 		i16x8 mvs_mask = ziplo16(absMvd_mask, absMvd_mask);
 		i32x4 mv = mvp + mvd;
 		i16x8 mvs = broadcast32(mv, 0);
-		mb->absMvd_l[i8x8] = ((i64x2)ifelse_mask(absMvd_mask, pack_absMvd(mvd), absMvd_old))[0];
+		mbp->absMvd_l[i8x8] = ((i64x2)ifelse_mask(absMvd_mask, pack_absMvd(mvd), absMvd_old))[0];
 		mb->mvs_v[i8x8] = ifelse_mask(mvs_mask, mvs, mb->mvs_v[i8x8]);
 		decode_inter(ctx, i, widths[type], heights[type]);
 	} while (mvd_flags &= mvd_flags - 1);
@@ -1524,7 +1547,7 @@ static inline void CAFUNC(parse_P_mb)
 	mb->Intra4x4PredMode_v = (i8x16){2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2};
 	mb->refIdx_l = (int64_t)(i8x8){0, 0, 0, 0, -1, -1, -1, -1};
 	#if CABAC
-		mb->absMvd_v[0] = mb->absMvd_v[1] = (i8x16){};
+		mbp->absMvd_v[0] = mbp->absMvd_v[1] = (i8x16){};
 	#endif
 	
 	// parse mb_skip_run/flag
@@ -1541,8 +1564,8 @@ static inline void CAFUNC(parse_P_mb)
 	
 	// earliest handling for P_Skip
 	if (mb_skip_flag) {
+		mb->f.mb_skip_flag = 1; // also exported with mb info
 		#if CABAC
-			mb->f.mb_skip_flag = 1;
 			ctx->mb_qp_delta_nz = 0;
 		#endif
 		decode_P_skip(ctx);
@@ -1576,19 +1599,19 @@ static inline void CAFUNC(parse_P_mb)
 	// decoding large blocks
 	if (mb_type == 0) { // 16x16
 		mb->f.inter_eqs_s = little_endian32(0x1b5fbbff);
-		i16x8 mvd = CACALL(parse_mvd_pair, mb->absMvd, 0);
+		i16x8 mvd = CACALL(parse_mvd_pair, mbp->absMvd, 0);
 		decode_inter_16x16(ctx, mvd, 0);
 	} else if (mb_type == 2) { // 8x16
 		mb->f.inter_eqs_s = little_endian32(0x1b1bbbbb);
-		i16x8 mvd0 = CACALL(parse_mvd_pair, mb->absMvd, 0);
+		i16x8 mvd0 = CACALL(parse_mvd_pair, mbp->absMvd, 0);
 		decode_inter_8x16_left(ctx, mvd0, 0);
-		i16x8 mvd1 = CACALL(parse_mvd_pair, mb->absMvd, 4);
+		i16x8 mvd1 = CACALL(parse_mvd_pair, mbp->absMvd, 4);
 		decode_inter_8x16_right(ctx, mvd1, 0);
 	} else { // 16x8
 		mb->f.inter_eqs_s = little_endian32(0x1b5f1b5f);
-		i16x8 mvd0 = CACALL(parse_mvd_pair, mb->absMvd, 0);
+		i16x8 mvd0 = CACALL(parse_mvd_pair, mbp->absMvd, 0);
 		decode_inter_16x8_top(ctx, mvd0, 0);
-		i16x8 mvd1 = CACALL(parse_mvd_pair, mb->absMvd, 8);
+		i16x8 mvd1 = CACALL(parse_mvd_pair, mbp->absMvd, 8);
 		decode_inter_16x8_bottom(ctx, mvd1, 0);
 	}
 	CAJUMP(parse_inter_residual);
@@ -1596,6 +1619,32 @@ static inline void CAFUNC(parse_P_mb)
 
 
 
+/**
+ * The number of bits consumed by each mb is measured from the position of the
+ * next unread bit, which for CABAC excludes the bits read ahead in codIOffset.
+ * Emulation prevention bytes are thus counted with the mb containing them.
+ */
+static always_inline size_t CAFUNC(get_bit_position) {
+	return (size_t)ctx->t._gb.CPB * 8 - CACOND(SIZE_BIT * 2 - 1 - ctz(ctx->t._gb.lsb_cache), SIZE_BIT - 9 - clz(ctx->t._gb.codIRange));
+}
+
+static noinline void CAFUNC(export_mb_maps) {
+	static const uint32_t partition_eqs[3] = {0x1b5fbbff, 0x1b5f1b5f, 0x1b1bbbbb}; // 16x16, 16x8, 8x16, then anything else
+	int mbs = ctx->t.pic_width_in_mbs * ctx->t.pic_height_in_mbs;
+	size_t pos = CACALL(get_bit_position);
+	int part = 0;
+	while (part < 3 && mb->f.inter_eqs_s != little_endian32(partition_eqs[part]))
+		part++;
+	ctx->t.mb_maps[ctx->CurrMbAddr] = mb->QP[0];
+	ctx->t.mb_maps[mbs + ctx->CurrMbAddr] = mb->mbIsInterFlag ? EDGE264_MB_INTER | mb->f.mb_skip_flag * EDGE264_MB_SKIP |
+		mb->f.transform_size_8x8_flag * EDGE264_MB_TRANSFORM_8x8 | part << 4 :
+		mb->f.mb_type_I_NxN * EDGE264_MB_I_NxN | mb->f.transform_size_8x8_flag * EDGE264_MB_TRANSFORM_8x8;
+	((uint16_t *)(ctx->t.mb_maps + mbs * 2))[ctx->CurrMbAddr] = min(pos - ctx->mb_bits_pos, UINT16_MAX);
+	ctx->mb_bits_pos = pos;
+}
+
+
+
 /**
  * This function loops through the macroblocks of a slice, initialising their
  * data and calling parse_{I/P/B}_mb for each one.
@@ -1622,6 +1671,8 @@ static void CAFUNC(parse_slice_data)
 	};
 	
 	int end_of_slice_flag = 0;
+	if (ctx->t.mb_maps)
+		ctx->mb_bits_pos = CACALL(get_bit_position);
 	do {
 		print_slice(ctx, "********** POC=%u MB=%u **********\n", ctx->PicOrderCnt, ctx->CurrMbAddr);
 		
@@ -1648,10 +1699,10 @@ static void CAFUNC(parse_slice_data)
 				ctx->A4x4_int8[2] = 7 - (int)sizeof(*mb);
 				ctx->A4x4_int8[8] = 13 - (int)sizeof(*mb);
 				ctx->A4x4_int8[10] = 15 - (int)sizeof(*mb);
-				ctx->absMvd_A[0] = 10 - (int)sizeof(*mb);
-				ctx->absMvd_A[2] = 14 - (int)sizeof(*mb);
-				ctx->absMvd_A[8] = 26 - (int)sizeof(*mb);
-				ctx->absMvd_A[10] = 30 - (int)sizeof(*mb);
+				ctx->absMvd_A[0] = 10 - (int)sizeof(*mbp);
+				ctx->absMvd_A[2] = 14 - (int)sizeof(*mbp);
+				ctx->absMvd_A[8] = 26 - (int)sizeof(*mbp);
+				ctx->absMvd_A[10] = 30 - (int)sizeof(*mbp);
 				ctx->mvs_A[0] = 5 - (int)(sizeof(*mb) >> 2);
 				ctx->mvs_A[2] = 7 - (int)(sizeof(*mb) >> 2);
 				ctx->mvs_A[8] = 13 - (int)(sizeof(*mb) >> 2);
@@ -1685,10 +1736,11 @@ static void CAFUNC(parse_slice_data)
 					ctx->B4x4_int8[1] = 11 - offB_int8;
 					ctx->B4x4_int8[4] = 14 - offB_int8;
 					ctx->B4x4_int8[5] = 15 - offB_int8;
-					ctx->absMvd_B[0] = 20 - offB_int8;
-					ctx->absMvd_B[1] = 22 - offB_int8;
-					ctx->absMvd_B[4] = 28 - offB_int8;
-					ctx->absMvd_B[5] = 30 - offB_int8;
+					int offB_mbp = (ctx->t.pic_width_in_mbs + 1) * (int)sizeof(*mbp);
+					ctx->absMvd_B[0] = 20 - offB_mbp;
+					ctx->absMvd_B[1] = 22 - offB_mbp;
+					ctx->absMvd_B[4] = 28 - offB_mbp;
+					ctx->absMvd_B[5] = 30 - offB_mbp;
 					ctx->mvs_B[0] = 10 - offB_int32;
 					ctx->mvs_B[1] = 11 - offB_int32;
 					ctx->mvs_B[4] = 14 - offB_int32;
@@ -1726,13 +1778,17 @@ static void CAFUNC(parse_slice_data)
 		ctx->unavail4x4_v = block_unavailability[unavail16x16];
 		ctx->inc.v = fA + fB + (fB & flags_twice.v);
 		mb->f.v = (i8x16){};
-		if (ctx->t.disable_deblocking_filter_idc != 1)
-			mb->filter_edges = filter_edges;
+		mb->filter_edges = (ctx->t.disable_deblocking_filter_idc != 1) ? filter_edges : 0;
 		mb->QP_s = ctx->t.QP_s;
+		mb->FilterOffsetA = ctx->t.FilterOffsetA;
+		mb->FilterOffsetB = ctx->t.FilterOffsetB;
+		mb->entropy_coding_mode_flag = ctx->t.pps.entropy_coding_mode_flag;
 		if (ctx->t.ChromaArrayType == 1) { // FIXME 4:2:2
 			mb->bits_l = (bitsA >> 3 & 0x11111100111111) | (bitsB >> 1 & 0x42424200424242);
 		}
 		mb->nC_v[0] = mb->nC_v[1] = mb->nC_v[2] = (i8x16){};
+		if (ctx->recon_ops)
+			record_op(ctx, OP_MB, 0, 0, mb)->dc = ctx->mbx | ctx->mby << 16;
 		
 		// Would it actually help to push this test outside the loop?
 		if (ctx->t.slice_type == 0) {
@@ -1750,6 +1806,10 @@ static void CAFUNC(parse_slice_data)
 			end_of_slice_flag = cabac_terminate(ctx);
 			print_slice(ctx, "end_of_slice_flag: %x\n", end_of_slice_flag);
 		#endif
+		if (ctx->t.mb_info)
+			export_mb_info(ctx);
+		if (ctx->t.mb_maps)
+			CACALL(export_mb_maps);
 		
 		// deblock mbB while in cache, then point to the next macroblock
 		if (ctx->CurrMbAddr - ctx->t.pic_width_in_mbs == ctx->t.next_deblock_addr) {
@@ -1772,23 +1832,34 @@ static void CAFUNC(parse_slice_data)
 		ctx->mbx++;
 		ctx->CurrMbAddr++;
 		ctx->mbCol++;
+		#if CABAC
+			mbp[-(ctx->t.pic_width_in_mbs + 3)] = *mbp;
+		#endif
+		if (++mbp == ctx->mbp_ring + (ctx->t.pic_width_in_mbs + 3) * 2)
+			mbp -= ctx->t.pic_width_in_mbs + 3;
 		if (ctx->mbx >= ctx->t.pic_width_in_mbs) {
 			mb++; // skip the empty macroblock at the edge
 			ctx->mbCol++;
+			#if CABAC
+				mbp[-(ctx->t.pic_width_in_mbs + 3)] = *mbp = (Edge264MbParse){}; // mbA of the next row
+			#endif
+			if (++mbp == ctx->mbp_ring + (ctx->t.pic_width_in_mbs + 3) * 2)
+				mbp -= ctx->t.pic_width_in_mbs + 3;
 			ctx->mby++;
 			ctx->mbx = 0;
 			ctx->samples_mb[0] += ctx->t.stride[0] * 16 - ctx->t.pic_width_in_mbs * 16;
 			ctx->samples_mb[1] += ctx->t.stride[1] * 8 - ctx->t.pic_width_in_mbs * 8; // FIXME 4:2:2
 			ctx->samples_mb[2] += ctx->t.stride[1] * 8 - ctx->t.pic_width_in_mbs * 8;
-			if (ctx->t.next_deblock_idc >= 0) {
-				__atomic_store_n(&ctx->d->next_deblock_addr[ctx->t.next_deblock_idc],
-					(ctx->t.disable_deblocking_filter_idc != 1) ? ctx->t.next_deblock_addr : ctx->CurrMbAddr,
-					__ATOMIC_RELEASE);
-				// not locking mutex here is fine since the last progress broadcast will lock it
-				pthread_cond_broadcast(&ctx->d->task_progress);
+			if (ctx->recon_ops) {
+				publish_recon_row(ctx);
+			} else if (ctx->t.next_deblock_idc >= 0) {
+				signal_progress(ctx, (ctx->t.disable_deblocking_filter_idc != 1 && !ctx->t.deblock_separately) ?
+					ctx->t.next_deblock_addr : ctx->CurrMbAddr);
 			}
 			if (ctx->mby >= ctx->t.pic_height_in_mbs)
 				return;
+			if (ctx->ref_frames && ctx->n_threads)
+				wait_ref_progress(ctx);
 		}
 	} while (CACOND(ctx->mb_skip_run > 0 || ctx->t._gb.msb_cache != (size_t)1 << (SIZE_BIT - 1) || (ctx->t._gb.lsb_cache & (ctx->t._gb.lsb_cache - 1)) || (intptr_t)(ctx->t._gb.end - ctx->t._gb.CPB) > 0, !end_of_slice_flag));
 }
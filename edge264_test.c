@@ -17,6 +17,10 @@
 	#include <sys/types.h>
 	#include <unistd.h>
 #endif
+#ifdef __linux__
+	#include <linux/perf_event.h>
+	#include <sys/syscall.h>
+#endif
 #include "edge264.h"
 
 
@@ -124,6 +128,7 @@ static int print_failed = 0;
 static int print_passed = 0;
 static int print_unsupported = 0;
 static int enable_yuv = 1;
+static int cross_check = 0;
 static const char *moveup = "";
 FILE *trace_headers = NULL;
 static Edge264Decoder *d;
@@ -264,6 +269,673 @@ static int check_frame()
 
 
 
+/**
+ * Cross-checking of decoding variants against the single-threaded decoding
+ * of a file, by comparing hashes of all output frames.
+ */
+typedef struct {
+	int32_t poc;
+	int8_t reference;
+	uint64_t planes[3]; // Y/Cb/Cr samples of both views, 0 if absent
+	uint64_t mb_info; // 0 if absent
+	uint64_t mb_maps; // QP, type and bits maps, 0 if absent
+} FrameHash;
+
+typedef struct {
+	const char *name;
+	int runs; // number of decodings, to catch nondeterministic outputs
+	int n_threads;
+	int alloc; // 1 to allocate frame buffers with counting_alloc
+	int length_size; // if not 0, the stream is converted to AVCC with this size of length prefixes
+	int chunk_size; // if not 0, the stream is passed to edge264_decode_chunk by chunks of 1 to chunk_size bytes
+	Edge264MbInfoMode mb_info;
+	int mb_maps;
+	int luma_only;
+	int scale_shift; // passed to edge264_set_output_scale
+	Edge264OutputFormat format;
+	Edge264PreallocMode prealloc;
+	Edge264DeblockMode deblock; // samples of non-reference frames are then not compared
+	int output_cb; // 1 to receive frames with edge264_set_output_cb instead of edge264_get_frame
+	int trim; // 1 to call edge264_trim_buffers after each NAL unit of Annex B input
+	int sched_stats; // 1 to require edge264_get_stats to report tasks reordered and refs prioritized by the scheduler
+	int pool_threads; // if not 0, the stream is decoded by several decoders sharing a pool with this many threads
+	int decoders; // number of decoders on the pool, all checked to output the same frames
+} Variant;
+
+/**
+ * Allocator lending frame buffers to a decoder, to check that output frames
+ * point inside them and that all are given back on edge264_free.
+ */
+typedef struct {
+	int live; // buffers not deallocated yet, negative after an unknown pointer
+	int total;
+	uint8_t *buffers[64];
+	size_t sizes[64];
+} CountingAllocator;
+
+static CountingAllocator counted;
+static const char *variant_error; // reason of the last EBADMSG returned by decode_variant
+
+static void *counting_alloc(void *alloc_arg, size_t size) {
+	CountingAllocator *a = alloc_arg;
+	int i = 0;
+	while (i < 64 && a->buffers[i] != NULL)
+		i++;
+	if (i == 64 || (a->buffers[i] = malloc(size)) == NULL)
+		return NULL;
+	a->sizes[i] = size;
+	a->live++;
+	a->total++;
+	return a->buffers[i];
+}
+
+static void counting_dealloc(void *alloc_arg, void *ptr) {
+	CountingAllocator *a = alloc_arg;
+	for (int i = 0; i < 64; i++) {
+		if (a->buffers[i] == ptr) {
+			free(ptr);
+			a->buffers[i] = NULL;
+			a->live--;
+			return;
+		}
+	}
+	a->live = -1000;
+}
+
+static int is_lent(const CountingAllocator *a, const uint8_t *first, const uint8_t *last) {
+	for (int i = 0; i < 64; i++) {
+		if (a->buffers[i] != NULL && first >= a->buffers[i] && last < a->buffers[i] + a->sizes[i])
+			return 1;
+	}
+	return 0;
+}
+
+static uint64_t hash_bytes(uint64_t h, const void *buf, size_t size) {
+	for (const uint8_t *p = buf; size > 0; size--, p++)
+		h = (h ^ *p) * 0x100000001b3; // FNV-1a
+	return h;
+}
+
+static uint64_t hash_plane(uint64_t h, const uint8_t *p, int stride, int width, int height) {
+	for (int y = 0; y < height; y++)
+		h = hash_bytes(h, p + y * stride, width);
+	return h;
+}
+
+static void hash_frame(const Edge264Frame *frm, FrameHash *h) {
+	h->poc = frm->TopFieldOrderCnt;
+	h->reference = frm->reference;
+	for (int i = 0; i < 3; i++) {
+		int stride = i ? frm->stride_C : frm->stride_Y;
+		int width = i ? frm->width_C << frm->pixel_depth_C : frm->width_Y << frm->pixel_depth_Y;
+		int height = i ? frm->height_C : frm->height_Y;
+		h->planes[i] = 0;
+		if (frm->samples[i] != NULL)
+			h->planes[i] = hash_plane(0xcbf29ce484222325, frm->samples[i], stride, width, height);
+		if (frm->samples_mvc[i] != NULL)
+			h->planes[i] = hash_plane(h->planes[i], frm->samples_mvc[i], stride, width, height);
+	}
+	h->mb_info = 0;
+	if (frm->mb_info != NULL)
+		h->mb_info = hash_bytes(0xcbf29ce484222325, frm->mb_info, frm->width_mbs * frm->height_mbs * sizeof(Edge264MbInfo));
+	h->mb_maps = 0;
+	if (frm->mb_qp_map != NULL) {
+		int mbs = frm->width_mbs * frm->height_mbs;
+		h->mb_maps = hash_bytes(0xcbf29ce484222325, frm->mb_qp_map, mbs);
+		h->mb_maps = hash_bytes(h->mb_maps, frm->mb_type_map, mbs);
+		h->mb_maps = hash_bytes(h->mb_maps, frm->mb_bits_map, mbs * sizeof(uint16_t));
+	}
+}
+
+/**
+ * Converts an Annex B stream to NAL units prefixed with their big-endian
+ * length, as stored in MP4 samples, and writes an avcC record with the first
+ * SPS and PPS. Returns the end of the converted stream, or NULL if a NAL unit
+ * is too large for length_size.
+ */
+static uint8_t *convert_to_AVCC(const uint8_t *buf, const uint8_t *end, int length_size, uint8_t *out, uint8_t avcC[], size_t *avcC_size) {
+	const uint8_t *sps = NULL, *pps = NULL;
+	size_t sps_size = 0, pps_size = 0;
+	const uint8_t *nal = edge264_find_start_code(buf, end);
+	while (nal < end) {
+		nal += 3;
+		const uint8_t *next = edge264_find_start_code(nal, end);
+		const uint8_t *nal_end = next;
+		while (nal_end > nal && nal_end[-1] == 0) // trailing_zero_8bits
+			nal_end--;
+		size_t size = nal_end - nal;
+		if (size == 0 || (uint64_t)size >> (length_size * 8) != 0)
+			return NULL;
+		for (int i = length_size; i-- > 0; )
+			*out++ = size >> (i * 8);
+		memcpy(out, nal, size);
+		out += size;
+		if ((nal[0] & 0x1f) == 7 && sps == NULL && size >= 4)
+			sps = nal, sps_size = size;
+		if ((nal[0] & 0x1f) == 8 && pps == NULL)
+			pps = nal, pps_size = size;
+		nal = next;
+	}
+	if (sps == NULL || pps == NULL || sps_size > 65535 || pps_size > 65535)
+		return NULL;
+	uint8_t *p = avcC;
+	*p++ = 1; // configurationVersion
+	*p++ = sps[1]; // AVCProfileIndication
+	*p++ = sps[2]; // profile_compatibility
+	*p++ = sps[3]; // AVCLevelIndication
+	*p++ = 0xfc | (length_size - 1);
+	*p++ = 0xe1; // numOfSequenceParameterSets
+	*p++ = sps_size >> 8;
+	*p++ = sps_size;
+	memcpy(p, sps, sps_size);
+	p += sps_size;
+	*p++ = 1; // numOfPictureParameterSets
+	*p++ = pps_size >> 8;
+	*p++ = pps_size;
+	memcpy(p, pps, pps_size);
+	*avcC_size = p + pps_size - avcC;
+	return out;
+}
+
+/**
+ * Checks a plane downscaled by edge264_set_output_scale against the rounded
+ * averages of blocks of 2x2 or 4x4 samples. Blocks are aligned on the
+ * uncropped frame, so they may start above and left of the cropped plane.
+ */
+static int check_scaled_plane(const uint8_t *scaled, int stride_scaled, const uint8_t *p, int stride, int width, int height, int top, int left, int shift) {
+	int n = 1 << shift;
+	for (int y = 0; y < height >> shift; y++) {
+		for (int x = 0; x < width >> shift; x++) {
+			const uint8_t *b = p + ((((top >> shift) + y) << shift) - top) * stride + ((((left >> shift) + x) << shift) - left);
+			int sum = 0;
+			for (int j = 0; j < n; j++) {
+				for (int i = 0; i < n; i++)
+					sum += b[j * stride + i];
+			}
+			if (scaled[y * stride_scaled + x] != (sum + n * n / 2) >> (shift * 2))
+				return 0;
+		}
+	}
+	return 1;
+}
+
+/**
+ * Checks that the NV12 or YUYV planes of a frame repack its I420 samples,
+ * with neutral chroma for luma-only frames.
+ */
+static int check_converted_yuv(const Edge264Frame *frm) {
+	int stride = frm->stride_converted;
+	for (int y = 0; y < frm->height_Y; y++) {
+		const uint8_t *sY = frm->samples[0] + y * frm->stride_Y;
+		const uint8_t *sCb = frm->samples[1] ? frm->samples[1] + (y >> 1) * frm->stride_C : NULL;
+		const uint8_t *sCr = frm->samples[2] ? frm->samples[2] + (y >> 1) * frm->stride_C : NULL;
+		const uint8_t *d = frm->samples_converted[0] + y * stride;
+		const uint8_t *dC = frm->samples_converted[1] + (y >> 1) * stride;
+		for (int x = 0; x < frm->width_Y; x++) {
+			int Cb = sCb ? sCb[x >> 1] : 128;
+			int Cr = sCr ? sCr[x >> 1] : 128;
+			if (frm->output_format == EDGE264_FORMAT_NV12 ?
+			    d[x] != sY[x] || dC[x & -2] != Cb || dC[x | 1] != Cr :
+			    d[x * 2] != sY[x] || d[(x & -2) * 2 + 1] != Cb || d[(x & -2) * 2 + 3] != Cr)
+				return 0;
+		}
+	}
+	return 1;
+}
+
+/**
+ * Checks the RGB24 or BGR24 plane of a frame, and the tensor obtained with
+ * edge264_convert_tensor, against a double precision conversion of its I420
+ * samples with equations E-28 to E-33, returning a description of the first
+ * failed check, or NULL.
+ */
+static const char *check_converted_rgb(Edge264Decoder *dec, const Edge264Frame *frm) {
+	static const float mean[3] = {0.485f, 0.456f, 0.406f};
+	static const float std[3] = {0.229f, 0.224f, 0.225f};
+	double Kr = 0.299, Kb = 0.114;
+	if (frm->matrix_coefficients == 1 || (frm->matrix_coefficients == 2 && frm->width_Y >= 1280)) {
+		Kr = 0.2126, Kb = 0.0722;
+	} else if (frm->matrix_coefficients == 9 || frm->matrix_coefficients == 10) {
+		Kr = 0.2627, Kb = 0.0593;
+	}
+	int bgr = frm->output_format == EDGE264_FORMAT_BGR24;
+	int w = frm->width_Y, h = frm->height_Y;
+	float *tensor = malloc(sizeof(float) * 3 * w * h);
+	if (tensor == NULL)
+		return "tensor allocation failed";
+	const char *error = NULL;
+	if (edge264_convert_tensor(dec, frm, tensor, 0, mean, std, bgr) != 0)
+		error = "edge264_convert_tensor failed";
+	for (int y = 0; y < h && error == NULL; y++) {
+		for (int x = 0; x < w && error == NULL; x++) {
+			int Y = frm->samples[0][y * frm->stride_Y + x];
+			int Cb = frm->samples[1] ? frm->samples[1][(y >> 1) * frm->stride_C + (x >> 1)] : 128;
+			int Cr = frm->samples[2] ? frm->samples[2][(y >> 1) * frm->stride_C + (x >> 1)] : 128;
+			double E_Y = frm->video_full_range_flag ? Y / 255. : (Y - 16) / 219.;
+			double E_Pb = (Cb - 128) / (frm->video_full_range_flag ? 255. : 224.);
+			double E_Pr = (Cr - 128) / (frm->video_full_range_flag ? 255. : 224.);
+			double R = E_Y + 2 * (1 - Kr) * E_Pr;
+			double B = E_Y + 2 * (1 - Kb) * E_Pb;
+			double rgb[3] = {R, (E_Y - Kr * R - Kb * B) / (1 - Kr - Kb), B};
+			const uint8_t *p = frm->samples_converted[0] + y * frm->stride_converted + x * 3;
+			for (int i = 0; i < 3; i++) {
+				double v = rgb[bgr ? 2 - i : i] * 255;
+				v = v < 0 ? 0 : v > 255 ? 255 : v;
+				double t = (tensor[(size_t)w * h * i + w * y + x] * std[i] + mean[i]) * 255;
+				if (p[i] < v - 1 || p[i] > v + 1)
+					error = bgr ? "BGR24 plane not matching the conversion of the I420 samples" : "RGB24 plane not matching the conversion of the I420 samples";
+				else if (t < v - 0.05 || t > v + 0.05)
+					error = "tensor not matching the conversion of the I420 samples";
+			}
+		}
+	}
+	free(tensor);
+	return error;
+}
+
+/**
+ * Checks the output of a frame for the settings of a variant, returning a
+ * description of the first failed check, or NULL.
+ */
+static const char *check_output(Edge264Decoder *dec, const Variant *v, const Edge264Frame *frm) {
+	if ((frm->mb_info != NULL) != (v->mb_info != EDGE264_MB_INFO_NONE))
+		return "mb_info not matching the mode of edge264_set_mb_info_mode";
+	if ((frm->mb_qp_map != NULL) != v->mb_maps || (frm->mb_type_map != NULL) != v->mb_maps || (frm->mb_bits_map != NULL) != v->mb_maps)
+		return "mb maps not matching edge264_set_mb_maps";
+	if (v->mb_info == EDGE264_MB_INFO_ONLY)
+		return frm->samples[0] != NULL ? "samples reconstructed in parse-only mode" : NULL;
+	if (v->luma_only && (frm->samples[1] != NULL || frm->samples[2] != NULL || frm->samples_mvc[1] != NULL || frm->samples_mvc[2] != NULL))
+		return "chroma planes output in luma-only mode";
+	if (frm->scale_shift != v->scale_shift || (frm->samples_scaled[0] != NULL) != (v->scale_shift > 0) ||
+	    (frm->samples_scaled[1] != NULL) != (v->scale_shift > 0 && frm->samples[1] != NULL))
+		return "scaled planes not matching edge264_set_output_scale";
+	if (v->scale_shift > 0 && frm->pixel_depth_Y == 0) {
+		int top = frm->frame_crop_offsets[0], left = frm->frame_crop_offsets[3];
+		if (!check_scaled_plane(frm->samples_scaled[0], frm->stride_scaled_Y, frm->samples[0], frm->stride_Y, frm->width_Y, frm->height_Y, top, left, v->scale_shift))
+			return "scaled Y plane not averaging the full-resolution one";
+		int topC = frm->height_C < frm->height_Y ? top >> 1 : top;
+		int leftC = frm->width_C < frm->width_Y ? left >> 1 : left;
+		for (int i = 1; i < 3 && frm->samples[1] != NULL; i++) {
+			if (!check_scaled_plane(frm->samples_scaled[i], frm->stride_scaled_C, frm->samples[i], frm->stride_C, frm->width_C, frm->height_C, topC, leftC, v->scale_shift))
+				return "scaled chroma planes not averaging the full-resolution ones";
+		}
+	}
+	if (frm->output_format != v->format || (frm->samples_converted[0] != NULL) != (v->format != EDGE264_FORMAT_I420) ||
+	    (frm->samples_converted[1] != NULL) != (v->format == EDGE264_FORMAT_NV12))
+		return "converted planes not matching edge264_set_output_format";
+	if ((v->format == EDGE264_FORMAT_NV12 || v->format == EDGE264_FORMAT_YUYV) && frm->pixel_depth_Y == 0 && !check_converted_yuv(frm))
+		return "converted planes not repacking the I420 samples";
+	if ((v->format == EDGE264_FORMAT_RGB24 || v->format == EDGE264_FORMAT_BGR24) && frm->pixel_depth_Y == 0) {
+		const char *error = check_converted_rgb(dec, frm);
+		if (error != NULL)
+			return error;
+	}
+	if (v->alloc && v->format != EDGE264_FORMAT_I420) {
+		int bytes = frm->width_Y * (v->format == EDGE264_FORMAT_NV12 ? 1 : v->format == EDGE264_FORMAT_YUYV ? 2 : 3);
+		const uint8_t *last = frm->samples_converted[0] + (frm->height_Y - 1) * frm->stride_converted + bytes - 1;
+		const uint8_t *last_C = frm->samples_converted[1] + (frm->height_C - 1) * frm->stride_converted + bytes - 1;
+		if (!is_lent(&counted, frm->samples_converted[0], last) ||
+		    (v->format == EDGE264_FORMAT_NV12 && !is_lent(&counted, frm->samples_converted[1], last_C)))
+			return "converted planes outside the buffers of alloc_cb";
+	}
+	if (v->alloc) {
+		const uint8_t *last_Y = frm->samples[0] + (frm->height_Y - 1) * frm->stride_Y + (frm->width_Y << frm->pixel_depth_Y) - 1;
+		const uint8_t *last_C = frm->samples[2] + (frm->height_C - 1) * frm->stride_C + (frm->width_C << frm->pixel_depth_C) - 1;
+		if (!is_lent(&counted, frm->samples[0], last_Y) || !is_lent(&counted, frm->samples[1], last_C))
+			return "frame planes outside the buffers of alloc_cb";
+	}
+	return NULL;
+}
+
+/**
+ * Checks and hashes an output frame at the end of an array, returning ENOMEM
+ * if the array could not grow, or EBADMSG if the frame failed check_output.
+ */
+static int add_frame(Edge264Decoder *dec, const Variant *v, const Edge264Frame *frm, FrameHash **frames, int *count, int *capacity) {
+	if ((variant_error = check_output(dec, v, frm)) != NULL)
+		return EBADMSG;
+	if (*count == *capacity) {
+		FrameHash *f = realloc(*frames, (*capacity * 2 + 64) * sizeof(FrameHash));
+		if (f == NULL)
+			return ENOMEM;
+		*frames = f;
+		*capacity = *capacity * 2 + 64;
+	}
+	hash_frame(frm, *frames + (*count)++);
+	return 0;
+}
+
+/**
+ * Hashes all frames ready for output, returning the first error of add_frame.
+ */
+static int hash_frames(Edge264Decoder *dec, const Variant *v, FrameHash **frames, int *count, int *capacity) {
+	Edge264Frame frm;
+	int err = 0;
+	while (!err && !edge264_get_frame(dec, &frm, 0))
+		err = add_frame(dec, v, &frm, frames, count, capacity);
+	return err;
+}
+
+/**
+ * Frames pushed by edge264_set_output_cb, possibly from worker threads. The
+ * callback runs with the decoder locked, so the array is never accessed
+ * concurrently, and the first error is kept until the end of decoding.
+ */
+typedef struct {
+	Edge264Decoder *dec;
+	const Variant *v;
+	FrameHash *frames;
+	int count;
+	int capacity;
+	int err;
+} OutputFrames;
+
+static void output_frame(void *output_arg, const Edge264Frame *frm) {
+	OutputFrames *o = output_arg;
+	if (!o->err)
+		o->err = add_frame(o->dec, o->v, frm, &o->frames, &o->count, &o->capacity);
+}
+
+static void apply_settings(Edge264Decoder *dec, const Variant *v) {
+	edge264_set_mb_info_mode(dec, v->mb_info);
+	edge264_set_mb_maps(dec, v->mb_maps);
+	edge264_set_luma_only(dec, v->luma_only);
+	edge264_set_output_scale(dec, v->scale_shift);
+	edge264_set_output_format(dec, v->format);
+	edge264_set_prealloc_mode(dec, v->prealloc);
+	edge264_set_deblock_mode(dec, v->deblock);
+}
+
+/**
+ * Decodes a whole Annex B stream with the settings of a variant, and returns
+ * the hashes of its frames in a new array.
+ */
+static int decode_variant(const Variant *v, const uint8_t *buf, const uint8_t *end, FrameHash **frames, int *count) {
+	*frames = NULL;
+	*count = 0;
+	int capacity = 0, res, err;
+	variant_error = NULL;
+	memset(&counted, 0, sizeof(counted));
+	
+	// convert the stream first if needed, skipping the variant if it does not fit
+	uint8_t *avcc = NULL, *avcc_end = NULL, *avcC = NULL;
+	size_t avcC_size;
+	if (v->length_size) {
+		if ((avcc = malloc((end - buf) * 2 + 16)) == NULL || (avcC = malloc(2 * 65536 + 16)) == NULL) {
+			free(avcc);
+			return ENOMEM;
+		}
+		if ((avcc_end = convert_to_AVCC(buf, end, v->length_size, avcc, avcC, &avcC_size)) == NULL) {
+			free(avcc);
+			free(avcC);
+			return ERANGE;
+		}
+	}
+	
+	Edge264Decoder *dec = edge264_alloc(v->n_threads, NULL, v->alloc ? counting_alloc : NULL, v->alloc ? counting_dealloc : NULL, &counted
+		#if EDGE264_TRACE
+			, NULL, NULL
+		#endif
+		);
+	if (dec == NULL) {
+		free(avcc);
+		free(avcC);
+		return ENOMEM;
+	}
+	apply_settings(dec, v);
+	OutputFrames pushed = {dec, v};
+	if (v->output_cb)
+		edge264_set_output_cb(dec, output_frame, &pushed, 0);
+	if (v->length_size) {
+		int length_size = 0;
+		res = edge264_decode_avcC(dec, avcC, avcC + avcC_size, &length_size);
+		err = 0;
+		if (res || length_size != v->length_size) {
+			variant_error = "avcC record rejected by edge264_decode_avcC";
+			err = EBADMSG;
+		}
+		const uint8_t *nal = avcc;
+		while (!err && (res == 0 || res == ENOBUFS)) {
+			res = edge264_decode_AVCC(dec, nal, avcc_end, length_size, 0, NULL, NULL, &nal);
+			err = hash_frames(dec, v, frames, count, &capacity);
+		}
+	} else if (v->chunk_size) {
+		const uint8_t *p = buf;
+		uint32_t seed = 1;
+		res = ENODATA;
+		err = 0;
+		while (!err && res == ENODATA && p < end) {
+			seed = seed * 1103515245 + 12345;
+			size_t n = 1 + (seed >> 16) % v->chunk_size;
+			const uint8_t *chunk_end = p + (n < end - p ? n : end - p);
+			do {
+				res = edge264_decode_chunk(dec, p, chunk_end, 0, &p);
+				err = hash_frames(dec, v, frames, count, &capacity);
+			} while (!err && (res == 0 || res == ENOBUFS));
+			if (!err && res == ENODATA && p != chunk_end) {
+				variant_error = "chunk not entirely consumed on ENODATA";
+				err = EBADMSG;
+			}
+		}
+		if (!err && res == ENODATA) { // end of stream
+			do {
+				res = edge264_decode_chunk(dec, NULL, NULL, 0, NULL);
+				err = hash_frames(dec, v, frames, count, &capacity);
+			} while (!err && (res == 0 || res == ENOBUFS));
+		}
+	} else {
+		const uint8_t *nal = buf + 3 + (buf[2] == 0);
+		do {
+			res = edge264_decode_NAL(dec, nal, end, 0, NULL, NULL, &nal);
+			err = hash_frames(dec, v, frames, count, &capacity);
+			if (v->trim)
+				edge264_trim_buffers(dec);
+		} while (!err && (res == 0 || res == ENOBUFS));
+	}
+	
+	// with more than 64 slices task indices are reused, so a backlog of slices
+	// must be picked out of index order, and refs ahead of any non-ref picture
+	if (!err && v->sched_stats) {
+		Edge264Stats stats;
+		edge264_get_stats(dec, &stats);
+		int non_ref = 0;
+		for (int i = 0; i < *count; i++)
+			non_ref |= !(*frames)[i].reference;
+		if (stats.tasks_started > 64 && stats.tasks_reordered == 0) {
+			variant_error = "no slice reordered by the scheduler";
+			err = EBADMSG;
+		} else if (stats.tasks_started > 64 && non_ref && stats.refs_prioritized == 0) {
+			variant_error = "no slice of reference picture prioritized by the scheduler";
+			err = EBADMSG;
+		}
+	}
+	edge264_free(&dec);
+	free(avcc);
+	free(avcC);
+	if (v->output_cb) {
+		if (!err && *count > 0) {
+			variant_error = "frames returned by edge264_get_frame while output_cb is set";
+			err = EBADMSG;
+		}
+		free(*frames);
+		*frames = pushed.frames;
+		*count = pushed.count;
+		if (!err)
+			err = pushed.err;
+	}
+	if (!err && v->alloc && (counted.live != 0 || counted.total == 0)) {
+		variant_error = "buffers of alloc_cb not all given back to dealloc_cb";
+		err = EBADMSG;
+	}
+	return err ? err : res == ENODATA ? 0 : res;
+}
+
+static const char *compare_frames(const Variant *v, const FrameHash *ref, const FrameHash *f) {
+	if (f->poc != ref->poc)
+		return "POC";
+	if (f->reference != ref->reference)
+		return "reference flag";
+	if (v->mb_info != EDGE264_MB_INFO_NONE && f->mb_info != ref->mb_info)
+		return "mb_info";
+	if (v->mb_maps && f->mb_maps != ref->mb_maps)
+		return "mb maps";
+	if (v->mb_info == EDGE264_MB_INFO_ONLY || (v->deblock == EDGE264_DEBLOCK_REF && !ref->reference))
+		return NULL;
+	if (f->planes[0] != ref->planes[0])
+		return "Y plane";
+	if (v->luma_only)
+		return NULL;
+	if (f->planes[1] != ref->planes[1] || f->planes[2] != ref->planes[2])
+		return "chroma planes";
+	return NULL;
+}
+
+/**
+ * Decodes a whole Annex B stream with several decoders sharing a pool, fed
+ * one NAL unit each in turn such that their tasks are consumed concurrently
+ * by the threads of the pool. Returns the hashes of the frames of the first
+ * decoder, after checking that all others output the same frames.
+ */
+static int decode_pooled(const Variant *v, const uint8_t *buf, const uint8_t *end, FrameHash **frames, int *count) {
+	Edge264Decoder *decs[16] = {};
+	FrameHash *f[16] = {};
+	int counts[16] = {}, capacities[16] = {}, res[16], err = 0;
+	const uint8_t *nals[16];
+	variant_error = NULL;
+	Edge264Pool *pool = edge264_pool_alloc(v->pool_threads);
+	for (int i = 0; i < v->decoders && !err; i++) {
+		decs[i] = pool == NULL ? NULL : edge264_alloc(0, pool, NULL, NULL, NULL
+			#if EDGE264_TRACE
+				, NULL, NULL
+			#endif
+			);
+		if (decs[i] == NULL) {
+			err = ENOMEM;
+		} else {
+			apply_settings(decs[i], v);
+			nals[i] = buf + 3 + (buf[2] == 0);
+			res[i] = 0;
+		}
+	}
+	for (int active = 1; active && !err; ) {
+		active = 0;
+		for (int i = 0; i < v->decoders && !err; i++) {
+			if (res[i] == 0 || res[i] == ENOBUFS) {
+				res[i] = edge264_decode_NAL(decs[i], nals[i], end, 0, NULL, NULL, nals + i);
+				err = hash_frames(decs[i], v, f + i, counts + i, capacities + i);
+				active = 1;
+			}
+		}
+	}
+	for (int i = 0; i < v->decoders; i++)
+		edge264_free(decs + i);
+	edge264_pool_free(&pool);
+	for (int i = 0; i < v->decoders && !err; i++) {
+		if (res[i] != ENODATA) {
+			err = res[i];
+		} else if (counts[i] != counts[0]) {
+			variant_error = "decoders sharing a pool output different numbers of frames";
+			err = EBADMSG;
+		}
+		for (int j = 0; j < counts[0] && !err; j++) {
+			if (compare_frames(v, f[0] + j, f[i] + j) != NULL) {
+				variant_error = "decoders sharing a pool output different frames";
+				err = EBADMSG;
+			}
+		}
+	}
+	for (int i = 1; i < v->decoders; i++)
+		free(f[i]);
+	*frames = f[0];
+	*count = counts[0];
+	return err;
+}
+
+/**
+ * Decodes a file again with each variant, and checks that all frames match
+ * the single-threaded decoding. Returns 1 on any mismatch.
+ */
+static int check_variants(const char *name, const uint8_t *buf, const uint8_t *end)
+{
+	static const Variant reference = {"single-threaded", 1, 0, .mb_info = EDGE264_MB_INFO_EXPORT, .mb_maps = 1};
+	static const Variant variants[] = {
+		{"1 thread", 4, 1, .sched_stats = 1}, // slices queue up, such that the scheduler picks among many
+		{"2 threads", 8, 2},
+		{"4 threads", 8, 4},
+		{"8 threads", 8, 8}, // mostly idle threads, such that slices get pipelined
+		{"8 decoders on a pool of 3 threads", 2, 0, .pool_threads = 3, .decoders = 8},
+		{"alloc_cb", 1, 0, .alloc = 1},
+		{"alloc_cb with 4 threads", 2, 4, .alloc = 1},
+		{"AVCC input", 1, 0, .length_size = 4},
+		{"AVCC input with 2-byte lengths and 4 threads", 2, 4, .length_size = 2},
+		{"chunked input", 1, 0, .chunk_size = 65536},
+		{"chunked input with small chunks and 4 threads", 2, 4, .chunk_size = 16},
+		{"mb_info export with 4 threads", 2, 4, .mb_info = EDGE264_MB_INFO_EXPORT},
+		{"parse-only mb_info", 1, 0, .mb_info = EDGE264_MB_INFO_ONLY},
+		{"parse-only mb_info with 4 threads", 2, 4, .mb_info = EDGE264_MB_INFO_ONLY},
+		{"mb maps with 4 threads", 2, 4, .mb_maps = 1},
+		{"parse-only mb_info and mb maps", 1, 0, .mb_info = EDGE264_MB_INFO_ONLY, .mb_maps = 1},
+		{"luma-only", 1, 0, .luma_only = 1},
+		{"luma-only with 4 threads and mb maps", 2, 4, .luma_only = 1, .mb_maps = 1},
+		{"output scale 1/2", 1, 0, .scale_shift = 1},
+		{"output scale 1/4 with 4 threads", 2, 4, .scale_shift = 2},
+		{"luma-only output scale 1/2 with 4 threads", 2, 4, .luma_only = 1, .scale_shift = 1},
+		{"NV12 output", 1, 0, .format = EDGE264_FORMAT_NV12},
+		{"NV12 output with alloc_cb and 4 threads", 2, 4, .alloc = 1, .format = EDGE264_FORMAT_NV12},
+		{"YUYV output with 4 threads", 2, 4, .format = EDGE264_FORMAT_YUYV},
+		{"luma-only NV12 output", 1, 0, .luma_only = 1, .format = EDGE264_FORMAT_NV12},
+		{"RGB24 output and tensor", 1, 0, .format = EDGE264_FORMAT_RGB24},
+		{"BGR24 output and tensor with 4 threads", 2, 4, .format = EDGE264_FORMAT_BGR24},
+		{"luma-only RGB24 output and tensor", 1, 0, .luma_only = 1, .format = EDGE264_FORMAT_RGB24},
+		{"prealloc with page faulting", 1, 0, .prealloc = EDGE264_PREALLOC_FAULT},
+		{"prealloc with mlock and 4 threads", 2, 4, .prealloc = EDGE264_PREALLOC_LOCK},
+		{"deblocking of reference frames only", 1, 0, .deblock = EDGE264_DEBLOCK_REF},
+		{"deblocking of reference frames only with 4 threads", 2, 4, .deblock = EDGE264_DEBLOCK_REF},
+		{"output_cb", 1, 0, .output_cb = 1},
+		{"output_cb with 4 threads", 4, 4, .output_cb = 1},
+		{"output_cb with 8 threads and mb maps", 2, 8, .output_cb = 1, .mb_maps = 1},
+		{"buffers trimmed after each NAL unit", 1, 0, .trim = 1},
+		{"buffers trimmed after each NAL unit with 4 threads", 4, 4, .trim = 1},
+		{"buffers of alloc_cb trimmed after each NAL unit with 4 threads", 2, 4, .alloc = 1, .trim = 1},
+	};
+	FrameHash *ref, *frames;
+	int n_ref, count, failed = 0;
+	if (decode_variant(&reference, buf, end, &ref, &n_ref)) {
+		free(ref);
+		return 0; // files that do not decode are already reported
+	}
+	for (int i = 0; i < sizeof(variants) / sizeof(*variants); i++) {
+		const Variant *v = variants + i;
+		for (int run = 0; run < v->runs && !failed; run++) {
+			int res = v->decoders ? decode_pooled(v, buf, end, &frames, &count) : decode_variant(v, buf, end, &frames, &count);
+			if (res == ERANGE) { // stream not representable in this variant
+				break;
+			} else if (res == EBADMSG && variant_error != NULL) {
+				fprintf(stderr, "%s: %s decoding failed check: %s\n", name, v->name, variant_error);
+				failed = 1;
+			} else if (res) {
+				fprintf(stderr, "%s: %s decoding failed with error %d\n", name, v->name, res);
+				failed = 1;
+			} else if (count != n_ref) {
+				fprintf(stderr, "%s: %s decoding output %d frames instead of %d\n", name, v->name, count, n_ref);
+				failed = 1;
+			}
+			for (int j = 0; j < count && j < n_ref && !failed; j++) {
+				const char *diff = compare_frames(v, ref + j, frames + j);
+				if (diff != NULL) {
+					fprintf(stderr, "%s: %s decoding differs in %s of frame %d (POC %d)\n", name, v->name, diff, j, ref[j].poc);
+					failed = 1;
+				}
+			}
+			free(frames);
+		}
+	}
+	free(ref);
+	return failed;
+}
+
+
+
 static int decode_file(const char *name0, int print_counts)
 {
 	// process file names
@@ -337,6 +1009,8 @@ static int decode_file(const char *name0, int print_counts)
 		const uint8_t *end1 = mm1 + st1.st_size;
 	#endif
 	
+	const uint8_t *start0 = nal;
+	
 	// print the success counts
 	if (!quit) {
 		if (print_counts) {
@@ -364,6 +1038,8 @@ static int decode_file(const char *name0, int print_counts)
 		} while (res == 0 || res == ENOBUFS);
 		if (res == ENOBUFS || (res == ENODATA && conf[0] != NULL && conf[0] != end1))
 			res = EBADMSG;
+		if (res == ENODATA && cross_check && check_variants(name0, start0, end0))
+			res = EBADMSG;
 		// FIXME interrupt all threads before closing the files!
 		
 		// print the file that was decoded
@@ -411,12 +1087,37 @@ static int decode_file(const char *name0, int print_counts)
 
 
 
+static int decode_input(const char *file_name, int is_dir, int print_counts)
+{
+	if (!is_dir)
+		return decode_file(file_name, 0);
+	#ifdef _WIN32
+		DIR *dp;
+		struct dirent *ep;
+		dp = opendir(".");
+		while ((ep = readdir(dp)) && !decode_file(ep->d_name, print_counts));
+		closedir(dp);
+	#else
+		struct dirent **entries;
+		int n = scandir(".", &entries, flt, cmp);
+		while (--n >= 0 && !decode_file(entries[n]->d_name, print_counts))
+			free(entries[n]);
+		for (; n >= 0; n--)
+			free(entries[n]);
+		free(entries);
+	#endif
+	return 0;
+}
+
+
+
 int main(int argc, char *argv[])
 {
 	// read command-line options
 	const char *file_name = "conformance";
 	int benchmark = 0;
 	int help = 0;
+	int huge_pages = 0;
 	int n_threads = -1;
 	FILE *trace_slices = NULL;
 	for (int i = 1; i < argc; i++) {
@@ -425,8 +1126,10 @@ int main(int argc, char *argv[])
 		} else for (int j = 1; argv[i][j]; j++) {
 			switch (argv[i][j]) {
 				case 'b': benchmark = 1; break;
+				case 'c': cross_check = 1; break;
 				case 'd': display = 1; break;
 				case 'f': print_failed = 1; break;
+				case 'H': huge_pages = 1; break;
 				case 'p': print_passed = 1; break;
 				case 's': n_threads = 0; break;
 				case 'u': print_unsupported = 1; break;
@@ -444,13 +1147,15 @@ int main(int argc, char *argv[])
 	
 	// print help if any argument was unknown
 	if (help) {
-		printf("Usage: " BOLD "%s [video.264|directory] [-hbdfpsuvVy]" RESET "\n"
+		printf("Usage: " BOLD "%s [video.264|directory] [-hbcdfHpsuvVy]" RESET "\n"
 			"Decodes a video or all videos inside a directory (./conformance by default),\n"
 			"comparing their outputs with inferred YUV pairs (.yuv and .1.yuv extensions).\n"
 			"-h\tprint this help and exit\n"
-			"-b\tbenchmark decoding time and memory usage\n"
+			"-b\tbenchmark decoding time, memory usage and dTLB misses with/without huge pages\n"
+			"-c\tcross-check threaded decoding and API variants against single-threaded\n"
 			"-d\tenable display of the videos (requires SDL2)\n"
 			"-f\tprint names of failed files in directory\n"
+			"-H\tback frame buffers with huge pages\n"
 			"-p\tprint names of passed files in directory\n"
 			"-s\tsingle-threaded operation\n"
 			"-u\tprint names of unsupported files in directory\n"
@@ -486,34 +1191,43 @@ int main(int argc, char *argv[])
 	
 	struct timespec t0, t1;
 	clock_gettime(CLOCK_MONOTONIC, &t0);
-	d = edge264_alloc(n_threads, trace_headers, trace_slices);
+	#if EDGE264_TRACE
+		d = edge264_alloc(n_threads, NULL, NULL, NULL, NULL, trace_headers, trace_slices);
+	#else
+		d = edge264_alloc(n_threads, NULL, NULL, NULL, NULL);
+	#endif
+	edge264_set_huge_pages(d, huge_pages);
+	
+	// count dTLB misses of all threads when benchmarking, if the kernel allows it
+	#ifdef __linux__
+		int tlb_fd = -1;
+		if (benchmark) {
+			struct perf_event_attr pe = {
+				.type = PERF_TYPE_HW_CACHE,
+				.size = sizeof(pe),
+				.config = PERF_COUNT_HW_CACHE_DTLB | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16,
+				.exclude_kernel = 1,
+				.inherit = 1,
+			};
+			tlb_fd = syscall(SYS_perf_event_open, &pe, 0, -1, -1, 0);
+		}
+	#endif
 	
 	// check if input is a directory by trying to move into it
-	if (chdir(file_name) < 0) {
-		int res = decode_file(file_name, 0);
-		if (res == ENOTSUP)
-			fprintf(stderr, "Decoding ended prematurely on " BOLD "unsupported stream" RESET "\n");
-		if (res == EBADMSG)
-			fprintf(stderr, "Decoding ended prematurely on " BOLD "decoding error" RESET "\n");
-	} else {
-		#ifdef _WIN32
-			DIR *dp;
-			struct dirent *ep;
-			dp = opendir(".");
-			while ((ep = readdir(dp)) && !decode_file(ep->d_name, 1));
-			closedir(dp);
-		#else
-			struct dirent **entries;
-			int n = scandir(".", &entries, flt, cmp);
-			while (--n >= 0 && !decode_file(entries[n]->d_name, 1))
-				free(entries[n]);
-			free(entries);
-		#endif
+	int is_dir = chdir(file_name) == 0;
+	int res = decode_input(file_name, is_dir, 1);
+	if (res == ENOTSUP)
+		fprintf(stderr, "Decoding ended prematurely on " BOLD "unsupported stream" RESET "\n");
+	if (res == EBADMSG)
+		fprintf(stderr, "Decoding ended prematurely on " BOLD "decoding error" RESET "\n");
+	if (is_dir) {
 		if (count_flag > 0)
 			printf("%s%d " GREEN "PASS" RESET ", %d " YELLOW "UNSUPPORTED" RESET ", %d " RED "FAIL" RESET ", %d " BLUE "FLAGGED" RESET "\n", moveup, count_pass, count_unsup, count_fail, count_flag);
 		else
 			printf("%s%d " GREEN "PASS" RESET ", %d " YELLOW "UNSUPPORTED" RESET ", %d " RED "FAIL" RESET "\n", moveup, count_pass, count_unsup, count_fail);
 	}
+	Edge264Stats stats;
+	edge264_get_stats(d, &stats);
 	edge264_free(&d);
 	
 	// close SDL if enabled
@@ -545,6 +1259,32 @@ int main(int argc, char *argv[])
 			long mem_kb = rusage.ru_maxrss / 1000;
 		#endif
 		printf("time: %.3lfs\nCPU: %.3lfs\nmemory: %.3lfMB\n", (double)time_msec / 1000, (double)cpu_msec / 1000, (double)mem_kb / 1000);
+		if (huge_pages)
+			printf("huge pages: %u frames explicit, %u frames transparent\n", stats.frames_hugetlb, stats.frames_thp);
+		
+		// decode again silently with huge pages toggled, to compare dTLB misses
+		#ifdef __linux__
+			long long tlb_misses[2];
+			if (tlb_fd >= 0 && read(tlb_fd, &tlb_misses[huge_pages], sizeof(long long)) == sizeof(long long)) {
+				cross_check = display = 0;
+				FILE *headers = trace_headers;
+				trace_headers = NULL;
+				#if EDGE264_TRACE
+					d = edge264_alloc(n_threads, NULL, NULL, NULL, NULL, NULL, NULL);
+				#else
+					d = edge264_alloc(n_threads, NULL, NULL, NULL, NULL);
+				#endif
+				edge264_set_huge_pages(d, !huge_pages);
+				decode_input(is_dir ? "." : file_name, is_dir, 0);
+				edge264_free(&d);
+				trace_headers = headers;
+				long long total;
+				if (read(tlb_fd, &total, sizeof(total)) == sizeof(total)) {
+					tlb_misses[!huge_pages] = total - tlb_misses[huge_pages];
+					printf("dTLB misses: %lld without huge pages, %lld with huge pages\n", tlb_misses[0], tlb_misses[1]);
+				}
+			}
+		#endif
 	}
 	if (trace_headers) {
 		fprintf(trace_headers, "</body>\n</html>\n");